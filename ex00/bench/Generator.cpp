@@ -0,0 +1,118 @@
+#include "Generator.hpp"
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+GeneratorOptions::GeneratorOptions() : rows(100000), lines(1000000), bad_ratio(0.05), seed(42) {}
+
+// xorshift64*: fast, and the same seed always gives the same files.
+static uint64_t next_random(uint64_t &state)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 2685821657736338717ULL;
+}
+
+static double next_unit(uint64_t &state)
+{
+	return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Days since 0001-01-01, the same numbering as the database index.
+static long civil_to_day(long year, long month, long day)
+{
+	year -= (month <= 2);
+	long era = year / 400;
+	long year_of_era = year - era * 400;
+	long day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	long day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+	return era * 146097 + day_of_era - 306;
+}
+
+static void day_to_civil(long number, char *out)
+{
+	number += 306;
+	long era = number / 146097;
+	long day_of_era = number - era * 146097;
+	long year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+	long day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+	long mp = (5 * day_of_year + 2) / 153;
+	long day = day_of_year - (153 * mp + 2) / 5 + 1;
+	long month = mp < 10 ? mp + 3 : mp - 9;
+	long year = year_of_era + era * 400 + (month <= 2);
+	std::sprintf(out, "%04ld-%02ld-%02ld", year, month, day);
+}
+
+bool generate_data(const std::string &dir, const GeneratorOptions &options)
+{
+	uint64_t state = options.seed ? options.seed : 1;
+	const long first_day = civil_to_day(1, 1, 1);
+	const long last_day = civil_to_day(2026, 12, 31);
+
+	// Steps of one to three days, shrunk to one when that many rows would
+	// not fit between year 1 and the end of 2026.
+	unsigned long rows = options.rows;
+	if (rows > static_cast<unsigned long>(last_day - first_day + 1))
+		rows = last_day - first_day + 1;
+	bool wide = rows * 3 <= static_cast<unsigned long>(last_day - first_day + 1);
+	std::vector<long> days(rows);
+	long day = last_day;
+	for (unsigned long i = rows; i-- > 0; )
+	{
+		days[i] = day;
+		day -= wide ? 1 + static_cast<long>(next_random(state) % 3) : 1;
+	}
+
+	char date[16];
+	std::ofstream db((dir + "/data.csv").c_str());
+	db << "date,exchange_rate\n";
+	double rate = 100.0;
+	for (unsigned long i = 0; i < rows; ++i)
+	{
+		rate *= 0.98 + 0.04 * next_unit(state);
+		day_to_civil(days[i], date);
+		char line[64];
+		std::sprintf(line, "%s,%.2f\n", date, rate);
+		db << line;
+	}
+	if (!db.good())
+		return false;
+
+	std::ofstream input((dir + "/input.txt").c_str());
+	input << "date | value\n";
+	long span = rows ? days.back() - days.front() + 31 : 31;
+	long start = rows ? days.front() - 30 : last_day - 30;
+	for (unsigned long i = 0; i < options.lines; ++i)
+	{
+		day_to_civil(start + static_cast<long>(next_random(state) % span), date);
+		char line[64];
+		if (next_unit(state) >= options.bad_ratio)
+		{
+			if (next_random(state) & 1)
+				std::sprintf(line, "%s | %.2f\n", date, 1000.0 * next_unit(state));
+			else
+				std::sprintf(line, "%s | %lu\n", date, static_cast<unsigned long>(next_random(state) % 1001));
+		}
+		else
+		{
+			switch (next_random(state) % 4)
+			{
+			case 0:
+				std::sprintf(line, "%.4s-13-%.2s | 1\n", date, date + 8);
+				break;
+			case 1:
+				std::sprintf(line, "%s 1.5\n", date);
+				break;
+			case 2:
+				std::sprintf(line, "%s | -%.2f\n", date, 1 + 100.0 * next_unit(state));
+				break;
+			default:
+				std::sprintf(line, "%s | %.2f\n", date, 1001 + 1000.0 * next_unit(state));
+				break;
+			}
+		}
+		input << line;
+	}
+	return input.good();
+}
@@ -0,0 +1,23 @@
+#ifndef GENERATOR_HPP
+#define GENERATOR_HPP
+
+#include <string>
+#include <stdint.h>
+
+struct GeneratorOptions
+{
+	unsigned long rows;
+	unsigned long lines;
+	double bad_ratio;
+	uint64_t seed;
+
+	GeneratorOptions();
+};
+
+// Writes a synthetic data.csv (rows dates, one to three days apart, ending
+// in 2026) and an input file of lines queries under dir. A bad_ratio share
+// of the queries is invalid, spread evenly over bad dates, missing
+// separators, negative and too large amounts. Returns false on I/O errors.
+bool generate_data(const std::string &dir, const GeneratorOptions &options);
+
+#endif
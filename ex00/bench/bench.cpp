@@ -0,0 +1,240 @@
+#include "BitcoinExchange.hpp"
+#include "MappedFile.hpp"
+#include "OutputBuffer.hpp"
+#include "Generator.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+
+// Measures btc stage by stage on generated data and prints one JSON object
+// per stage on stdout, e.g. for a regression tracker to collect:
+//   {"stage":"lookup","lines":950000,"seconds":0.0213,"lines_per_sec":...}
+// Each stage runs --repeat times and the fastest run is reported.
+
+struct BenchOptions
+{
+	GeneratorOptions data;
+	std::string dir;
+	unsigned int repeat;
+	bool dense;
+	bool generate_only;
+};
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *stage, unsigned long lines, double seconds)
+{
+	std::printf("{\"stage\":\"%s\",\"lines\":%lu,\"seconds\":%.6f,\"lines_per_sec\":%.0f,\"ns_per_line\":%.2f}\n",
+		stage, lines, seconds, seconds > 0 ? lines / seconds : 0.0,
+		lines ? seconds * 1e9 / lines : 0.0);
+}
+
+static void print_usage(const char *name)
+{
+	std::fprintf(stderr, "Usage: %s [--rows N] [--lines N] [--bad RATIO] [--seed N]\n"
+		"       [--repeat N] [--dense] [--dir DIR] [--generate-only]\n", name);
+}
+
+static bool parse_options(int ac, char **av, BenchOptions &options)
+{
+	options.dir = "bench_data";
+	options.repeat = 3;
+	options.dense = false;
+	options.generate_only = false;
+	for (int i = 1; i < ac; ++i)
+	{
+		std::string arg = av[i];
+		bool has_value = i + 1 < ac;
+		if (arg == "--dense")
+			options.dense = true;
+		else if (arg == "--generate-only")
+			options.generate_only = true;
+		else if (!has_value)
+			return false;
+		else if (arg == "--rows")
+			options.data.rows = std::strtoul(av[++i], NULL, 10);
+		else if (arg == "--lines")
+			options.data.lines = std::strtoul(av[++i], NULL, 10);
+		else if (arg == "--bad")
+			options.data.bad_ratio = std::strtod(av[++i], NULL);
+		else if (arg == "--seed")
+			options.data.seed = std::strtoul(av[++i], NULL, 10);
+		else if (arg == "--repeat")
+			options.repeat = std::strtoul(av[++i], NULL, 10);
+		else if (arg == "--dir")
+			options.dir = av[++i];
+		else
+			return false;
+	}
+	if (options.repeat == 0)
+		options.repeat = 1;
+	return true;
+}
+
+// Line ranges of the input after its header.
+static void split_input(const MappedFile &input, std::vector<const char *> &begins,
+	std::vector<const char *> &ends)
+{
+	const char *cursor = input.begin();
+	const char *end = input.end();
+	bool header = true;
+	while (cursor < end)
+	{
+		const char *newline = static_cast<const char *>(std::memchr(cursor, '\n', end - cursor));
+		if (newline == NULL)
+			newline = end;
+		if (!header)
+		{
+			begins.push_back(cursor);
+			ends.push_back(newline);
+		}
+		header = false;
+		cursor = newline + 1;
+	}
+}
+
+int main(int ac, char **av)
+{
+	BenchOptions options;
+	if (!parse_options(ac, av, options))
+	{
+		print_usage(av[0]);
+		return 1;
+	}
+	if ((mkdir(options.dir.c_str(), 0755) != 0 && errno != EEXIST)
+		|| !generate_data(options.dir, options.data))
+	{
+		std::fprintf(stderr, "Error: could not write bench data under %s\n", options.dir.c_str());
+		return 1;
+	}
+	if (options.generate_only)
+		return 0;
+	if (chdir(options.dir.c_str()) != 0)
+		return 1;
+	std::printf("{\"config\":{\"rows\":%lu,\"lines\":%lu,\"bad_ratio\":%g,\"seed\":%llu,\"repeat\":%u,\"dense\":%s}}\n",
+		options.data.rows, options.data.lines, options.data.bad_ratio,
+		static_cast<unsigned long long>(options.data.seed), options.repeat, options.dense ? "true" : "false");
+
+	try
+	{
+		ExchangeOptions exchange_options;
+		exchange_options.dense = options.dense;
+
+		// Load: the csv parse (snapshot removed first), then the snapshot.
+		// The csv load also writes the snapshot; its stats lap is reported
+		// as a stage of its own and left out of load_csv.
+		ExchangeOptions load_options = exchange_options;
+		load_options.stats = true;
+		double best = 0;
+		double best_write = 0;
+		for (unsigned int r = 0; r < options.repeat; ++r)
+		{
+			std::remove("data.csv.snap");
+			double start = now();
+			BitcoinExchange exchange(load_options);
+			double write = exchange.stats().seconds[STAGE_DB_SNAPSHOT_WRITE];
+			double elapsed = now() - start - write;
+			if (r == 0 || elapsed < best)
+				best = elapsed;
+			if (r == 0 || write < best_write)
+				best_write = write;
+		}
+		report("load_csv", options.data.rows, best);
+		report("snapshot_write", options.data.rows, best_write);
+		for (unsigned int r = 0; r < options.repeat; ++r)
+		{
+			double start = now();
+			BitcoinExchange exchange(exchange_options);
+			double elapsed = now() - start;
+			if (r == 0 || elapsed < best)
+				best = elapsed;
+		}
+		report("load_snapshot", options.data.rows, best);
+
+		BitcoinExchange exchange(exchange_options);
+		MappedFile input;
+		if (!input.open("input.txt"))
+			return 1;
+		std::vector<const char *> begins;
+		std::vector<const char *> ends;
+		split_input(input, begins, ends);
+		std::size_t count = begins.size();
+		std::vector<Query> queries(count);
+
+		// Validation: splitting and checking every line.
+		for (unsigned int r = 0; r < options.repeat; ++r)
+		{
+			double start = now();
+			for (std::size_t i = 0; i < count; ++i)
+				exchange.parse_line(begins[i], ends[i], queries[i]);
+			double elapsed = now() - start;
+			if (r == 0 || elapsed < best)
+				best = elapsed;
+		}
+		report("validation", count, best);
+
+		// Lookup: the rate search for every line that validated.
+		std::vector<std::size_t> valid;
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			if (queries[i].status == LINE_OK)
+				valid.push_back(i);
+		}
+		volatile double checksum = 0;
+		for (unsigned int r = 0; r < options.repeat; ++r)
+		{
+			double start = now();
+			for (std::size_t i = 0; i < valid.size(); ++i)
+			{
+				Query &query = queries[valid[i]];
+				if (exchange.lookup(query))
+					checksum += query.rate;
+			}
+			double elapsed = now() - start;
+			if (r == 0 || elapsed < best)
+				best = elapsed;
+		}
+		report("lookup", valid.size(), best);
+		for (std::size_t i = 0; i < valid.size(); ++i)
+		{
+			if (!exchange.lookup(queries[valid[i]]))
+				queries[valid[i]].status = LINE_BAD_INPUT;
+		}
+
+		// Formatting: results and error messages into memory, no write(2).
+		std::string sink;
+		for (unsigned int r = 0; r < options.repeat; ++r)
+		{
+			OutputBuffer out(-1, 0);
+			double start = now();
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				print_query(queries[i], out);
+				if ((i & 0xffff) == 0xffff)
+					out.release(sink);
+			}
+			out.release(sink);
+			double elapsed = now() - start;
+			if (r == 0 || elapsed < best)
+				best = elapsed;
+		}
+		report("formatting", count, best);
+	}
+	catch (const std::exception &e)
+	{
+		std::fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
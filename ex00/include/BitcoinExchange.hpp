@@ -3,8 +3,14 @@
 
 #include <iostream>
 #include <algorithm>
-#include <map>
+#include <vector>
+#include <stdint.h>
+#include <sys/stat.h>
 #include <stdexcept>
+#include <pthread.h>
+#include "RunStats.hpp"
+#include "MappedFile.hpp"
+#include "RowArray.hpp"
 
 class ValidationException : public std::runtime_error
 {
@@ -36,22 +42,182 @@ public:
 	InvalidValueException(const std::string &message);
 };
 
+class OutputBuffer;
+class PipelinedReader;
+
+struct ExchangeOptions
+{
+	bool dense;
+	bool batch;
+	unsigned int jobs;
+	bool serve;
+	bool stats;
+	bool verify;
+	std::string socket_path;
+
+	ExchangeOptions();
+};
+
+enum DateStatus
+{
+	DATE_OK,
+	DATE_BAD_FORMAT,
+	DATE_INVALID
+};
+
+// Validates a "YYYY-MM-DD" date and stores its day number in days.
+DateStatus check_date(const char *begin, const char *end, uint32_t &days);
+
+// Outcome of one input line; each value maps to one user-visible message.
+enum LineStatus
+{
+	LINE_OK,
+	LINE_BAD_INPUT,
+	LINE_NOT_POSITIVE,
+	LINE_TOO_LARGE
+};
+
+enum QueryKind
+{
+	QUERY_POINT,
+	QUERY_RANGE
+};
+
+// What a "FROM .. TO | x" line asks for: the sum, average, minimum or
+// maximum rate over the range, or for a number, the value of that many
+// coins bought on every database date in the range.
+enum Aggregate
+{
+	AGG_AMOUNT,
+	AGG_SUM,
+	AGG_AVG,
+	AGG_MIN,
+	AGG_MAX
+};
+
+struct Query
+{
+	LineStatus status;
+	QueryKind kind;
+	Aggregate aggregate;
+	std::string trimmed;
+	std::string date;
+	std::string amount_token;
+	std::size_t asset;
+	uint32_t day;
+	uint32_t last_day;
+	double amount;
+	double rate;
+};
+
+// One database rate column, row-aligned with the shared date index.
+struct RateColumn
+{
+	std::string name;
+	RowArray<double> rates;
+};
+
+// Range structures over one column's rates, for range queries.
+struct RangeIndex
+{
+	std::vector<long double> prefix;
+	std::vector<std::vector<double> > block_min;
+	std::vector<std::vector<double> > block_max;
+};
+
+// Where the index stands in data.csv, so that a reload can tell an append
+// from a rewrite without reading the whole file again: the file's identity,
+// length and mtime when indexed, the bytes up to its last complete line,
+// and a hash of the window just before that end.
+struct DbSource
+{
+	std::size_t bytes;
+	std::size_t size;
+	unsigned long inode;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t window_hash;
+	long lines;
+
+	DbSource();
+};
+
+enum ReloadKind
+{
+	RELOAD_NONE,
+	RELOAD_APPEND,
+	RELOAD_FULL
+};
+
+// Rows appended to data.csv, parsed aside by scan_appended() and indexed by
+// apply_appended(). When the live rows are views into the snapshot, whole
+// is set and days and rates hold every row, so applying them is a swap
+// rather than a copy.
+struct DbAppend
+{
+	bool whole;
+	std::vector<uint32_t> days;
+	std::vector<std::vector<double> > rates;
+	DbSource source;
+};
 
 class BitcoinExchange
 {
 private:
-	std::map<std::string, double> _db;
+	ExchangeOptions _options;
+	RunStats _stats;
+	MappedFile _snapshot;
+	RowArray<uint32_t> _days;
+	std::vector<RateColumn> _columns;
+	std::vector<uint32_t> _dense_rows;
+	// Built by the first range query, possibly on a worker thread, hence
+	// mutable and guarded by _ranges_lock.
+	mutable std::vector<RangeIndex> _ranges;
+	mutable bool _ranges_built;
+	mutable pthread_mutex_t _ranges_lock;
+	static const std::size_t aggregate_block = 32;
+	DbSource _source;
 	BitcoinExchange();
-	void validate(std::string file);
+	void remember_source(const MappedFile &input, const struct stat &source);
+	void build_dense(std::size_t first);
+	bool find_row(uint32_t day, std::size_t &row) const;
+	void build_aggregates(std::size_t first) const;
+	void require_aggregates() const;
+	void range_extrema(std::size_t asset, std::size_t first, std::size_t last,
+		double &low, double &high) const;
+	bool aggregate_range(Query &query) const;
+	void answer_block(std::vector<Query> &queries, std::size_t count,
+		std::vector<std::size_t> &order) const;
+	void print_batch(PipelinedReader &input, OutputBuffer &out);
+	void answer_range(const char *begin, const char *end, OutputBuffer &out,
+		unsigned long *outcomes) const;
+	void load();
+	void run(const std::string &file);
+	void execute(const std::string &file);
+	static void answer_chunk(void *context, unsigned int index);
+	void print_parallel(const std::string &file);
+	void print_timed(PipelinedReader &input, OutputBuffer &out);
 public:
 	
 	BitcoinExchange(std::string file);
+	BitcoinExchange(std::string file, const ExchangeOptions &options);
+	explicit BitcoinExchange(const ExchangeOptions &options);
 	BitcoinExchange(const BitcoinExchange& other);
 	BitcoinExchange& operator=(const BitcoinExchange& other);
 	~BitcoinExchange();
 	
 	void fill_db();
+	ReloadKind scan_appended(DbAppend &append) const;
+	void apply_appended(DbAppend &append);
+	BitcoinExchange *reloaded() const;
 	void print_all(std::string file);
+	void parse_line(const char *begin, const char *end, Query &query) const;
+	bool lookup(Query &query) const;
+	void answer_line(const char *begin, const char *end, Query &query, OutputBuffer &out) const;
+	const RunStats &stats() const;
 };
 
+void trim_range(const char *&begin, const char *&end);
+void print_query(const Query &query, OutputBuffer &out);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,30 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+class MappedFile
+{
+private:
+	const char *_data;
+	std::size_t _size;
+	bool _mapped;
+	std::vector<char> _buffer;
+
+	MappedFile(const MappedFile &other);
+	MappedFile &operator=(const MappedFile &other);
+	void release();
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool open(const std::string &path);
+	void swap(MappedFile &other);
+	const char *begin() const;
+	const char *end() const;
+	std::size_t size() const;
+};
+
+#endif
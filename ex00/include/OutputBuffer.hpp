@@ -0,0 +1,32 @@
+#ifndef OUTPUTBUFFER_HPP
+#define OUTPUTBUFFER_HPP
+
+#include <string>
+#include <cstddef>
+
+// Accumulates output and hands it to write(2) in large blocks. With a
+// negative descriptor it only collects, e.g. for a worker's private chunk.
+class OutputBuffer
+{
+private:
+	int _fd;
+	std::size_t _capacity;
+	std::string _data;
+
+	OutputBuffer(const OutputBuffer &other);
+	OutputBuffer &operator=(const OutputBuffer &other);
+public:
+	explicit OutputBuffer(int fd, std::size_t capacity = 1 << 16);
+	~OutputBuffer();
+
+	void append(const char *data, std::size_t size);
+	void append(const std::string &text);
+	void append(char c);
+	void append_double(double value);
+	void flush();
+	void release(std::string &target);
+};
+
+std::size_t format_double(double value, char *out);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+typedef void (*ParallelTask)(void *context, unsigned int index);
+
+// Runs task(context, i) for every i in [0, count), one thread each, and
+// returns once all of them finished. An exception escaping a task is
+// rethrown here as std::runtime_error after every thread has joined.
+void run_parallel(unsigned int count, ParallelTask task, void *context);
+
+unsigned int hardware_threads();
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef PIPELINEDREADER_HPP
+#define PIPELINEDREADER_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <pthread.h>
+
+// Hands out the lines of a file while a background thread keeps reading
+// ahead with read() into a small ring of large buffers, so that I/O latency
+// overlaps with whatever the caller does per line. Lines are returned in
+// place; only a line that straddles two buffers is copied. A read error
+// ends the input, as it would for std::getline.
+class PipelinedReader
+{
+private:
+	struct Buffer
+	{
+		std::vector<char> data;
+		std::size_t size;
+		bool last;
+	};
+
+	int _fd;
+	std::vector<Buffer> _ring;
+	std::size_t _filled;
+	std::size_t _drained;
+	bool _stop;
+	bool _threaded;
+	pthread_t _thread;
+	pthread_mutex_t _lock;
+	pthread_cond_t _ready;
+	pthread_cond_t _space;
+	Buffer *_current;
+	const char *_cursor;
+	const char *_end;
+	bool _done;
+	std::string _carry;
+
+	PipelinedReader(const PipelinedReader &other);
+	PipelinedReader &operator=(const PipelinedReader &other);
+	static void *read_loop(void *arg);
+	bool fill(Buffer &buffer);
+	bool acquire();
+	void release();
+	void close();
+public:
+	PipelinedReader(std::size_t buffer_size = 1 << 20, std::size_t buffers = 4);
+	~PipelinedReader();
+
+	bool open(const std::string &path);
+	bool next_line(const char *&begin, const char *&end);
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef QUERYSERVER_HPP
+#define QUERYSERVER_HPP
+
+#include "BitcoinExchange.hpp"
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+class OutputBuffer;
+
+// Keeps a loaded BitcoinExchange resident and answers "date | amount" lines
+// from stdin or from clients of a Unix domain socket. Every complete line
+// already received is answered before the replies are flushed, so a client
+// may pipeline whole batches. "stats" reports the request count and a
+// latency histogram, "quit" closes the connection. data.csv is watched with
+// inotify; a change is examined on a reload thread, which parses appended
+// rows or loads a whole new exchange while requests go on against the
+// current one, and the result is indexed or swapped in between requests.
+// Events arriving during a reload are folded into one more. Client sockets
+// are non-blocking: replies queue per connection and drain on POLLOUT, and
+// a connection whose queue is over output_limit is not read until it
+// drains, so a client that never reads only stalls itself.
+class QueryServer
+{
+private:
+	struct Connection
+	{
+		int in_fd;
+		int out_fd;
+		bool closing;
+		std::string pending;
+		std::string output;
+		std::size_t written;
+
+		Connection(int in, int out);
+	};
+
+	// What the reload thread was given and what it produced.
+	struct Reload
+	{
+		const BitcoinExchange *exchange;
+		ReloadKind kind;
+		DbAppend append;
+		BitcoinExchange *rebuilt;
+		std::string error;
+		int notify_fd;
+	};
+
+	static const std::size_t output_limit = 1 << 20;
+
+	BitcoinExchange *_exchange;
+	BitcoinExchange *_owned;
+	int _listen_fd;
+	int _watch_fd;
+	int _reload_fds[2];
+	pthread_t _reload_thread;
+	bool _reloading;
+	bool _reload_pending;
+	Reload _reload;
+	std::string _socket_path;
+	std::vector<Connection> _connections;
+	unsigned long _requests;
+	unsigned long _latency[64];
+	Query _query;
+
+	QueryServer();
+	QueryServer(const QueryServer &other);
+	QueryServer &operator=(const QueryServer &other);
+
+	void run();
+	void watch_database();
+	void database_changed();
+	static void *reload_database(void *context);
+	void start_reload();
+	void finish_reload();
+	bool read_connection(Connection &connection);
+	bool flush_connection(Connection &connection);
+	bool answer(const char *begin, const char *end, OutputBuffer &out);
+	void print_stats(OutputBuffer &out) const;
+	void close_connection(std::size_t index);
+public:
+	QueryServer(BitcoinExchange &exchange);
+	~QueryServer();
+
+	void serve_stdio();
+	void serve_socket(const std::string &path);
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef RATESNAPSHOT_HPP
+#define RATESNAPSHOT_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/stat.h>
+
+class MappedFile;
+
+// Binary image of a validated rate database, stored next to the csv it was
+// compiled from. Layout: header, asset names (each ending in '\n'), day
+// numbers (uint32), then one array of rates (double) per asset, every
+// section padded to 8 bytes. The header records the source size and mtime,
+// so a stale snapshot is simply rebuilt, plus a checksum of the payload.
+// Reading checks the header and section sizes and then uses the day and
+// rate arrays in place, so opening a snapshot costs the same whatever the
+// history length; the checksum, a pass over the whole payload, is only
+// checked when the caller asks for it.
+struct SnapshotHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t count;
+	uint64_t assets;
+	uint64_t names_size;
+	uint64_t source_size;
+	int64_t source_mtime_sec;
+	int64_t source_mtime_nsec;
+	uint64_t checksum;
+};
+
+// Arrays of an open snapshot, pointing into the MappedFile it was read
+// from; rates holds one array of count values per name.
+struct SnapshotView
+{
+	std::vector<std::string> names;
+	const uint32_t *days;
+	const double *rates;
+	std::size_t count;
+};
+
+const uint64_t checksum_seed = 14695981039346656037ULL;
+
+uint64_t checksum(uint64_t hash, const char *data, std::size_t size);
+bool read_snapshot(const std::string &path, const struct stat &source, bool verify,
+	MappedFile &file, SnapshotView &view);
+bool write_snapshot(const std::string &path, const struct stat &source,
+	const std::vector<std::string> &names, const uint32_t *days, std::size_t count,
+	const std::vector<const double *> &columns);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef ROWARRAY_HPP
+#define ROWARRAY_HPP
+
+#include <vector>
+#include <cstddef>
+
+// Database rows that are either owned or viewed in memory kept alive by
+// someone else, i.e. the mapped snapshot. A view is never written: appends
+// copy it to owned storage first, and so does copying the array, so a copy
+// never depends on the mapping.
+template <typename T>
+class RowArray
+{
+private:
+	const T *_data;
+	std::size_t _size;
+	bool _viewing;
+	std::vector<T> _owned;
+
+	void own()
+	{
+		_data = _owned.empty() ? NULL : &_owned[0];
+		_size = _owned.size();
+		_viewing = false;
+	}
+public:
+	RowArray() : _data(NULL), _size(0), _viewing(false) {}
+
+	RowArray(const RowArray &other) : _data(NULL), _size(0), _viewing(false)
+	{
+		*this = other;
+	}
+
+	RowArray &operator=(const RowArray &other)
+	{
+		if (this != &other)
+		{
+			_owned.assign(other.begin(), other.end());
+			own();
+		}
+		return *this;
+	}
+
+	void view(const T *data, std::size_t size)
+	{
+		std::vector<T>().swap(_owned);
+		_data = data;
+		_size = size;
+		_viewing = true;
+	}
+
+	void swap(std::vector<T> &values)
+	{
+		_owned.swap(values);
+		own();
+	}
+
+	void append(const T *begin, const T *end)
+	{
+		if (_viewing)
+			_owned.assign(_data, _data + _size);
+		_owned.insert(_owned.end(), begin, end);
+		own();
+	}
+
+	bool viewing() const { return _viewing; }
+	std::size_t size() const { return _size; }
+	bool empty() const { return _size == 0; }
+	const T *begin() const { return _data; }
+	const T *end() const { return _data + _size; }
+	const T &operator[](std::size_t index) const { return _data[index]; }
+	const T &front() const { return _data[0]; }
+	const T &back() const { return _data[_size - 1]; }
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef RUNSTATS_HPP
+#define RUNSTATS_HPP
+
+#include <cstddef>
+
+enum StatsStage
+{
+	STAGE_DB_OPEN,
+	STAGE_DB_SNAPSHOT_READ,
+	STAGE_DB_PARSE,
+	STAGE_DB_MERGE,
+	STAGE_DB_SNAPSHOT_WRITE,
+	STAGE_DB_INDEX,
+	STAGE_INPUT_READ,
+	STAGE_VALIDATE,
+	STAGE_LOOKUP,
+	STAGE_FORMAT,
+	STAGE_ANSWER,
+	STAGE_COUNT
+};
+
+// Opt-in (--stats) stage timings and per-outcome line counts for one run,
+// printed to stderr by print(). Everything is guarded by enabled, so with
+// stats off each probe costs one predictable branch.
+struct RunStats
+{
+	static const std::size_t outcome_count = 4;
+
+	bool enabled;
+	double seconds[STAGE_COUNT];
+	unsigned long runs[STAGE_COUNT];
+	unsigned long outcomes[outcome_count];
+
+	RunStats();
+	double start() const;
+	void lap(StatsStage stage, double &since);
+	void add(StatsStage stage, double elapsed);
+	void print() const;
+};
+
+double monotonic_seconds();
+
+// Charges the time until it goes out of scope to one stage.
+class StageTimer
+{
+private:
+	RunStats &_stats;
+	StatsStage _stage;
+	double _start;
+
+	StageTimer(const StageTimer &other);
+	StageTimer &operator=(const StageTimer &other);
+public:
+	StageTimer(RunStats &stats, StatsStage stage);
+	~StageTimer();
+};
+
+#endif
@@ -1,11 +1,19 @@
 #include "BitcoinExchange.hpp"
-#include <fstream>
+#include "MappedFile.hpp"
+#include "RateSnapshot.hpp"
+#include "Parallel.hpp"
+#include "OutputBuffer.hpp"
+#include "QueryServer.hpp"
+#include "PipelinedReader.hpp"
 #include <sstream>
 #include <cstdlib>
 #include <cerrno>
 #include <cmath>
+#include <cfloat>
 #include <cctype>
+#include <cstring>
 #include <algorithm>
+#include <unistd.h>
 
 ValidationException::ValidationException(const std::string &message) : std::runtime_error(message) {}
 
@@ -17,13 +25,23 @@ InvalidDateException::InvalidDateException(const std::string &message) : Validat
 
 InvalidValueException::InvalidValueException(const std::string &message) : ValidationException(message) {}
 
-std::string trim(const std::string &value)
+bool is_trim_space(char c)
 {
-	std::string::size_type start = value.find_first_not_of(" \t\r\n");
-	if (start == std::string::npos)
-		return "";
-	std::string::size_type end = value.find_last_not_of(" \t\r\n");
-	return value.substr(start, end - start + 1);
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+void trim_range(const char *&begin, const char *&end)
+{
+	while (begin != end && is_trim_space(*begin))
+		++begin;
+	while (end != begin && is_trim_space(*(end - 1)))
+		--end;
+}
+
+const char *next_line(const char *begin, const char *end)
+{
+	const char *newline = static_cast<const char *>(std::memchr(begin, '\n', end - begin));
+	return newline ? newline : end;
 }
 
 bool is_leap_year(int year)
@@ -31,6 +49,17 @@ bool is_leap_year(int year)
 	return (year % 400 == 0) || (year % 4 == 0 && year % 100 != 0);
 }
 
+// Days since 0001-01-01 in the proleptic Gregorian calendar.
+uint32_t date_to_day(int year, int month, int day)
+{
+	static const int days_before_month[] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+	int y = year - 1;
+	uint32_t days = y * 365 + y / 4 - y / 100 + y / 400 + days_before_month[month - 1] + day - 1;
+	if (month > 2 && is_leap_year(year))
+		++days;
+	return days;
+}
+
 std::string to_string_int(int value)
 {
 	std::ostringstream oss;
@@ -38,262 +67,1412 @@ std::string to_string_int(int value)
 	return oss.str();
 }
 
-void validate_date(const std::string &date, int line_number)
+// Decodes "YYYY-MM-DD" a word at a time: the eight digits are gathered
+// into one 64-bit value, range-checked together and then folded pairwise
+// (byte i becomes 10 * digit[i] + digit[i + 1]).
+DateStatus check_date(const char *begin, const char *end, uint32_t &days)
 {
-	if (date.size() != 10 || date[4] != '-' || date[7] != '-')
-		throw InvalidDateException("Error: invalid date format at line " +
-			to_string_int(line_number) +
-			": " + date);
+	if (end - begin != 10 || begin[4] != '-' || begin[7] != '-')
+		return DATE_BAD_FORMAT;
 
-	for (int i = 0; i < 10; ++i)
-	{
-		if (i == 4 || i == 7)
-			continue;
-		if (!std::isdigit(date[i]))
-			throw InvalidDateException("Error: invalid date format at line " +
-				to_string_int(line_number) +
-				": " + date);
-	}
+	char digits[8];
+	std::memcpy(digits, begin, 4);
+	std::memcpy(digits + 4, begin + 5, 2);
+	std::memcpy(digits + 6, begin + 8, 2);
+	uint64_t word;
+	std::memcpy(&word, digits, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	word = __builtin_bswap64(word);
+#endif
+
+	// Every byte is '0'..'9' iff its high nibble is 3 both before and after
+	// adding 6.
+	const uint64_t high_nibbles = 0xF0F0F0F0F0F0F0F0ULL;
+	if (((word & high_nibbles) | (((word + 0x0606060606060606ULL) & high_nibbles) >> 4))
+		!= 0x3333333333333333ULL)
+		return DATE_BAD_FORMAT;
 
-	int year = std::atoi(date.substr(0, 4).c_str());
-	int month = std::atoi(date.substr(5, 2).c_str());
-	int day = std::atoi(date.substr(8, 2).c_str());
+	word -= 0x3030303030303030ULL;
+	word = word * 10 + (word >> 8);
+	int year = static_cast<int>(word & 0xFF) * 100 + static_cast<int>((word >> 16) & 0xFF);
+	int month = static_cast<int>((word >> 32) & 0xFF);
+	int day = static_cast<int>((word >> 48) & 0xFF);
 
 	if (year < 1 || year > 2026 || month < 1 || month > 12)
-		throw InvalidDateException("Error: invalid date at line " +
-			to_string_int(line_number) +
-			": " + date);
+		return DATE_INVALID;
 
 	int month_days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
 	if (is_leap_year(year))
 		month_days[1] = 29;
 
 	if (day < 1 || day > month_days[month - 1])
+		return DATE_INVALID;
+
+	days = date_to_day(year, month, day);
+	return DATE_OK;
+}
+
+uint32_t validate_date(const char *begin, const char *end, int line_number)
+{
+	uint32_t days = 0;
+	DateStatus status = check_date(begin, end, days);
+	if (status == DATE_BAD_FORMAT)
+		throw InvalidDateException("Error: invalid date format at line " +
+			to_string_int(line_number) +
+			": " + std::string(begin, end));
+	if (status == DATE_INVALID)
 		throw InvalidDateException("Error: invalid date at line " +
 			to_string_int(line_number) +
-			": " + date);
+			": " + std::string(begin, end));
+	return days;
 }
 
-double parse_amount(const std::string &raw_value, int line_number)
+bool is_digit(char c)
 {
-	std::string value = trim(raw_value);
-	if (value.empty())
-		throw InvalidValueException("Error: empty amount at line " +
-			to_string_int(line_number));
+	return c >= '0' && c <= '9';
+}
 
-	char *end_ptr = NULL;
-	errno = 0;
-	double amount = std::strtod(value.c_str(), &end_ptr);
+// Clinger's fast path: when the significand fits in 53 bits and the power
+// of ten is at most 1e22, both are exact doubles and one IEEE multiply or
+// divide yields the correctly rounded result, i.e. the value strtod returns.
+// Returns false for anything else (long significands, large exponents, hex,
+// inf/nan, malformed text) so the caller can defer to strtod.
+bool fast_decimal(const char *p, const char *end, double &parsed)
+{
+	static const double powers_of_ten[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
 
-	if (value.c_str() == end_ptr || *end_ptr != '\0' || errno == ERANGE || !std::isfinite(amount))
-		throw InvalidValueException("Error: invalid amount at line " +
-			to_string_int(line_number) +
-			": " + value);
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD != 0
+	(void)p;
+	(void)end;
+	(void)parsed;
+	(void)powers_of_ten;
+	return false;
+#else
+	bool negative = false;
+	if (p != end && (*p == '+' || *p == '-'))
+		negative = (*p++ == '-');
 
-	if (amount < 0.0)
-		throw InvalidValueException("Error: amount must be non-negative at line " +
-			to_string_int(line_number) +
-			": " + value);
+	uint64_t significand = 0;
+	int digits = 0;
+	int exponent = 0;
+	bool seen_digit = false;
+	for (; p != end && is_digit(*p); ++p)
+	{
+		seen_digit = true;
+		if ((significand != 0 || *p != '0') && ++digits > 19)
+			return false;
+		significand = significand * 10 + (*p - '0');
+	}
+	if (p != end && *p == '.')
+	{
+		for (++p; p != end && is_digit(*p); ++p)
+		{
+			seen_digit = true;
+			if ((significand != 0 || *p != '0') && ++digits > 19)
+				return false;
+			significand = significand * 10 + (*p - '0');
+			--exponent;
+		}
+	}
+	if (!seen_digit)
+		return false;
 
-	if (amount > 1000.0)
-		throw InvalidValueException("Error: amount exceeds max (1000) at line " +
-			to_string_int(line_number) +
-			": " + value);
+	if (p != end && (*p == 'e' || *p == 'E'))
+	{
+		++p;
+		bool negative_exponent = false;
+		if (p != end && (*p == '+' || *p == '-'))
+			negative_exponent = (*p++ == '-');
+		if (p == end || !is_digit(*p))
+			return false;
+		int written = 0;
+		for (; p != end && is_digit(*p); ++p)
+		{
+			if (written < 10000)
+				written = written * 10 + (*p - '0');
+		}
+		exponent += negative_exponent ? -written : written;
+	}
+	if (p != end)
+		return false;
 
-	return amount;
+	if (significand > (static_cast<uint64_t>(1) << 53) || exponent < -22 || exponent > 22)
+		return false;
+	double value = static_cast<double>(significand);
+	value = (exponent < 0) ? value / powers_of_ten[-exponent] : value * powers_of_ten[exponent];
+	parsed = negative ? -value : value;
+	return true;
+#endif
 }
 
-double parse_double_value(const std::string &raw_value, int line_number)
+// Decimal conversion shared by amounts and rates: the whole token must be
+// consumed and the result must be finite and in range. Plain decimals take
+// the allocation-free fast path; the rest get strtod's exact semantics.
+bool parse_decimal(const char *begin, const char *end, double &parsed)
 {
-	std::string value = trim(raw_value);
-	if (value.empty())
-		throw InvalidValueException("Error: empty database value at line " +
-			to_string_int(line_number));
+	if (fast_decimal(begin, end, parsed))
+		return true;
+
+	// strtod needs a terminated string; numbers fit the stack buffer, the
+	// rest take the slow path so arbitrarily long garbage is still rejected.
+	char buffer[64];
+	std::string long_value;
+	const char *value = buffer;
+	std::size_t size = end - begin;
+	if (size < sizeof(buffer))
+	{
+		std::memcpy(buffer, begin, size);
+		buffer[size] = '\0';
+	}
+	else
+	{
+		long_value.assign(begin, end);
+		value = long_value.c_str();
+	}
 
 	char *end_ptr = NULL;
 	errno = 0;
-	double parsed = std::strtod(value.c_str(), &end_ptr);
+	parsed = std::strtod(value, &end_ptr);
+	return !(value == end_ptr || *end_ptr != '\0' || errno == ERANGE || !std::isfinite(parsed));
+}
+
+LineStatus check_amount(const char *begin, const char *end, double &amount)
+{
+	trim_range(begin, end);
+	if (begin == end || !parse_decimal(begin, end, amount))
+		return LINE_BAD_INPUT;
+	if (amount < 0.0)
+		return LINE_NOT_POSITIVE;
+	if (amount > 1000.0)
+		return LINE_TOO_LARGE;
+	return LINE_OK;
+}
 
-	if (value.c_str() == end_ptr || *end_ptr != '\0' || errno == ERANGE || !std::isfinite(parsed))
+double parse_double_value(const char *begin, const char *end, int line_number)
+{
+	trim_range(begin, end);
+	if (begin == end)
+		throw InvalidValueException("Error: empty database value at line " +
+			to_string_int(line_number));
+
+	double parsed;
+	if (!parse_decimal(begin, end, parsed))
 		throw InvalidValueException("Error: invalid database value at line " +
 			to_string_int(line_number) +
-			": " + value);
+			": " + std::string(begin, end));
 
 	return parsed;
 }
 
-BitcoinExchange::BitcoinExchange() {}
+struct DayOrder
+{
+	const std::vector<uint32_t> &days;
+	DayOrder(const std::vector<uint32_t> &values) : days(values) {}
+	bool operator()(std::size_t a, std::size_t b) const
+	{
+		return days[a] < days[b];
+	}
+};
+
+// Sorts rows by date; a date listed more than once keeps its last rates.
+// rates holds stride values per row.
+void sort_by_day(std::vector<uint32_t> &days, std::vector<double> &rates, std::size_t stride)
+{
+	std::size_t i = 1;
+	while (i < days.size() && days[i - 1] < days[i])
+		++i;
+	if (i >= days.size())
+		return;
+
+	std::vector<std::size_t> order(days.size());
+	for (i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), DayOrder(days));
+
+	std::vector<uint32_t> sorted_days;
+	std::vector<double> sorted_rates;
+	sorted_days.reserve(days.size());
+	sorted_rates.reserve(rates.size());
+	for (i = 0; i < order.size(); ++i)
+	{
+		const double *row = &rates[order[i] * stride];
+		if (!sorted_days.empty() && sorted_days.back() == days[order[i]])
+			std::copy(row, row + stride, sorted_rates.end() - stride);
+		else
+		{
+			sorted_days.push_back(days[order[i]]);
+			sorted_rates.insert(sorted_rates.end(), row, row + stride);
+		}
+	}
+	days.swap(sorted_days);
+	rates.swap(sorted_rates);
+}
+
+ExchangeOptions::ExchangeOptions() : dense(false), batch(false), jobs(1), serve(false), stats(false), verify(false) {}
+
+DbSource::DbSource() : bytes(0), size(0), inode(0), mtime_sec(0), mtime_nsec(0), window_hash(0), lines(-1) {}
+
+// Reads "date,NAME[,NAME...]", one rate column per asset. Names are trimmed
+// and must be non-empty, free of blanks and distinct; the classic
+// "date,exchange_rate" is a database with the single asset exchange_rate.
+std::vector<std::string> parse_db_header(const char *begin, const char *end)
+{
+	const char *comma = static_cast<const char *>(std::memchr(begin, ',', end - begin));
+	const char *date_begin = begin;
+	const char *date_end = (comma == NULL) ? end : comma;
+	trim_range(date_begin, date_end);
+	if (comma == NULL || std::string(date_begin, date_end) != "date")
+		throw BadInputException("Error: invalid database header");
+
+	std::vector<std::string> names;
+	while (comma != NULL)
+	{
+		const char *name_begin = comma + 1;
+		comma = static_cast<const char *>(std::memchr(name_begin, ',', end - name_begin));
+		const char *name_end = (comma == NULL) ? end : comma;
+		trim_range(name_begin, name_end);
+		std::string name(name_begin, name_end);
+		if (name.empty() || std::find_if(name.begin(), name.end(), is_trim_space) != name.end()
+			|| std::find(names.begin(), names.end(), name) != names.end())
+			throw BadInputException("Error: invalid database header");
+		names.push_back(name);
+	}
+	return names;
+}
+
+// Parses "date,rate[,rate...]" with exactly columns rates, stored in rates.
+void parse_db_line(const char *begin, const char *end, int line_number, std::size_t columns,
+	uint32_t &day, double *rates)
+{
+	const char *trimmed_begin = begin;
+	const char *trimmed_end = end;
+	trim_range(trimmed_begin, trimmed_end);
+	if (trimmed_begin == trimmed_end)
+		throw BadInputException("Error: empty database line at line " + to_string_int(line_number));
+
+	if (static_cast<std::size_t>(std::count(begin, end, ',')) != columns)
+		throw BadInputException("Error: invalid database line format at line " +
+			to_string_int(line_number) +
+			": " + std::string(begin, end));
+
+	const char *comma = static_cast<const char *>(std::memchr(begin, ',', end - begin));
+	const char *date_begin = begin;
+	const char *date_end = comma;
+	trim_range(date_begin, date_end);
+
+	day = validate_date(date_begin, date_end, line_number);
+	for (std::size_t i = 0; i < columns; ++i)
+	{
+		const char *field = comma + 1;
+		comma = (i + 1 < columns)
+			? static_cast<const char *>(std::memchr(field, ',', end - field)) : end;
+		rates[i] = parse_double_value(field, comma, line_number);
+	}
+}
+
+// Cuts [begin, end) into parts ranges that each start at a line start.
+std::vector<const char *> split_lines(const char *begin, const char *end, unsigned int parts)
+{
+	std::vector<const char *> bounds;
+	bounds.push_back(begin);
+	for (unsigned int i = 1; i < parts; ++i)
+	{
+		const char *split = begin + (end - begin) * i / parts;
+		if (split < bounds.back())
+			split = bounds.back();
+		if (split != begin && split[-1] != '\n')
+		{
+			split = next_line(split, end);
+			if (split != end)
+				++split;
+		}
+		bounds.push_back(split);
+	}
+	bounds.push_back(end);
+	return bounds;
+}
+
+// Rows are kept row-major (columns rates per date) while loading, so that
+// sorting and merging move whole rows; they are split into per-asset
+// columns once loading is done.
+struct DbChunkJob
+{
+	std::size_t columns;
+	std::vector<const char *> bounds;
+	std::vector<std::vector<uint32_t> > days;
+	std::vector<std::vector<double> > rates;
+	std::vector<const char *> errors;
+};
+
+// Parses one range into a sorted run. Line numbers are unknown here, so a
+// rejected line only records where it starts.
+void parse_db_chunk(void *context, unsigned int index)
+{
+	DbChunkJob *job = static_cast<DbChunkJob *>(context);
+	const char *cursor = job->bounds[index];
+	const char *end = job->bounds[index + 1];
+	std::vector<uint32_t> &days = job->days[index];
+	std::vector<double> &rates = job->rates[index];
+	days.reserve((end - cursor) / 20);
+	rates.reserve((end - cursor) / 20 * job->columns);
+	std::vector<double> row(job->columns);
+
+	while (cursor < end)
+	{
+		const char *line_end = next_line(cursor, end);
+		uint32_t day;
+		try
+		{
+			parse_db_line(cursor, line_end, 0, job->columns, day, &row[0]);
+		}
+		catch (const ValidationException &)
+		{
+			job->errors[index] = cursor;
+			return;
+		}
+		days.push_back(day);
+		rates.insert(rates.end(), row.begin(), row.end());
+		cursor = line_end + 1;
+	}
+	sort_by_day(days, rates, job->columns);
+}
+
+// Merges two sorted runs; on equal dates the later run's rates win, as they
+// came from further down the file.
+void merge_pair(std::vector<uint32_t> &days, std::vector<double> &rates,
+	std::vector<uint32_t> &later_days, std::vector<double> &later_rates, std::size_t stride)
+{
+	if (later_days.empty())
+		return;
+	if (days.empty() || days.back() < later_days.front())
+	{
+		days.insert(days.end(), later_days.begin(), later_days.end());
+		rates.insert(rates.end(), later_rates.begin(), later_rates.end());
+	}
+	else
+	{
+		std::vector<uint32_t> merged_days;
+		std::vector<double> merged_rates;
+		merged_days.reserve(days.size() + later_days.size());
+		merged_rates.reserve(rates.size() + later_rates.size());
+		std::size_t i = 0;
+		std::size_t j = 0;
+		while (i < days.size() || j < later_days.size())
+		{
+			if (j == later_days.size() || (i < days.size() && days[i] < later_days[j]))
+			{
+				merged_days.push_back(days[i]);
+				merged_rates.insert(merged_rates.end(), rates.begin() + i * stride,
+					rates.begin() + (i + 1) * stride);
+				++i;
+			}
+			else
+			{
+				if (i < days.size() && days[i] == later_days[j])
+					++i;
+				merged_days.push_back(later_days[j]);
+				merged_rates.insert(merged_rates.end(), later_rates.begin() + j * stride,
+					later_rates.begin() + (j + 1) * stride);
+				++j;
+			}
+		}
+		days.swap(merged_days);
+		rates.swap(merged_rates);
+	}
+	std::vector<uint32_t>().swap(later_days);
+	std::vector<double>().swap(later_rates);
+}
+
+struct MergeJob
+{
+	std::vector<std::vector<uint32_t> > *days;
+	std::vector<std::vector<double> > *rates;
+	std::size_t stride;
+	std::size_t step;
+};
+
+void merge_step(void *context, unsigned int index)
+{
+	MergeJob *job = static_cast<MergeJob *>(context);
+	std::size_t left = index * 2 * job->step;
+	std::size_t right = left + job->step;
+	if (right < job->days->size())
+		merge_pair((*job->days)[left], (*job->rates)[left], (*job->days)[right], (*job->rates)[right],
+			job->stride);
+}
+
+// Pairwise merge of the per-chunk runs into runs[0], one level per round
+// with the merges of a level running in parallel.
+void merge_runs(std::vector<std::vector<uint32_t> > &days, std::vector<std::vector<double> > &rates,
+	std::size_t stride)
+{
+	MergeJob job;
+	job.days = &days;
+	job.rates = &rates;
+	job.stride = stride;
+	for (job.step = 1; job.step < days.size(); job.step *= 2)
+	{
+		std::size_t pairs = (days.size() + 2 * job.step - 1) / (2 * job.step);
+		run_parallel(pairs, merge_step, &job);
+	}
+}
+
+BitcoinExchange::BitcoinExchange() : _ranges_built(false)
+{
+	pthread_mutex_init(&_ranges_lock, NULL);
+}
+
+// 2026-12-31, the last date check_date accepts.
+static const uint32_t max_day = date_to_day(2026, 12, 31);
 
 void BitcoinExchange::fill_db()
 {
 	const std::string db_file = "data.csv";
-	std::ifstream input(db_file.c_str());
-	if (!input.is_open())
+	if (db_file.size() < 4 || db_file.substr(db_file.size() - 4) != ".csv")
+		throw BadInputException("Error: database file must be a .csv file: " + db_file);
+
+	double stage_start = _stats.start();
+	MappedFile input;
+	if (!input.open(db_file))
 		throw FileOpenException("Error: could not open database file: " + db_file);
+	_stats.lap(STAGE_DB_OPEN, stage_start);
 
-	_db.clear();
+	// A snapshot compiled from this exact csv (same size and mtime) replaces
+	// parsing altogether; otherwise the csv is parsed and the snapshot redone.
+	const std::string snapshot_file = db_file + ".snap";
+	struct stat source;
+	bool have_source = stat(db_file.c_str(), &source) == 0;
+	// The rows are then served straight from the mapping, which _snapshot
+	// keeps alive. Its checksum is checked on request and by servers, which
+	// live long enough to pay for it; the days are always bounds-checked,
+	// as lookups rely on them being sorted and the dense table is sized by
+	// the first and last.
+	MappedFile snapshot;
+	SnapshotView view;
+	bool verify = _options.verify || _options.serve || !_options.socket_path.empty();
+	bool have_snapshot = have_source && read_snapshot(snapshot_file, source, verify, snapshot, view);
+	if (have_snapshot && view.count > 0
+		&& (view.days[0] > view.days[view.count - 1] || view.days[view.count - 1] > max_day))
+		have_snapshot = false;
+	_stats.lap(STAGE_DB_SNAPSHOT_READ, stage_start);
+	if (have_snapshot)
+	{
+		std::vector<RateColumn> columns(view.names.size());
+		for (std::size_t i = 0; i < columns.size(); ++i)
+		{
+			columns[i].name.swap(view.names[i]);
+			columns[i].rates.view(view.rates + i * view.count, view.count);
+		}
+		_days.view(view.days, view.count);
+		_columns.swap(columns);
+		_snapshot.swap(snapshot);
+		remember_source(input, source);
+		return;
+	}
+	std::vector<std::string> names;
 
-	std::string line;
-	int line_number = 0;
-	if (!std::getline(input, line))
+	const char *cursor = input.begin();
+	const char *file_end = input.end();
+	if (cursor == file_end)
 		throw BadInputException("Error: database file is empty");
-	++line_number;
 
-	if (trim(line) != "date,exchange_rate")
-		throw BadInputException("Error: invalid database header");
+	const char *line_end = next_line(cursor, file_end);
+	names = parse_db_header(cursor, line_end);
+
+	// Validation and loading share one pass; rows go into scratch arrays
+	// that only replace the index once every line has been accepted. Large
+	// files are cut into newline-aligned ranges parsed on one thread per
+	// core; --jobs only governs how the input is answered.
+	const char *data = (line_end == file_end) ? file_end : line_end + 1;
+	unsigned int parts = hardware_threads();
+	if (static_cast<std::size_t>(file_end - data) < (1u << 20))
+		parts = 1;
 
-	while (std::getline(input, line))
+	DbChunkJob job;
+	job.columns = names.size();
+	job.bounds = split_lines(data, file_end, parts);
+	job.days.resize(parts);
+	job.rates.resize(parts);
+	job.errors.assign(parts, static_cast<const char *>(NULL));
+	run_parallel(parts, parse_db_chunk, &job);
+
+	// The earliest failing chunk holds the first bad line; parsing that line
+	// again with its real line number raises exactly the serial error.
+	for (unsigned int i = 0; i < parts; ++i)
 	{
-		++line_number;
-		if (trim(line).empty())
-			throw BadInputException("Error: empty database line at line " + to_string_int(line_number));
+		if (job.errors[i] == NULL)
+			continue;
+		int line_number = 2 + std::count(data, job.errors[i], '\n');
+		uint32_t day;
+		std::vector<double> row(job.columns);
+		parse_db_line(job.errors[i], next_line(job.errors[i], file_end), line_number, job.columns, day, &row[0]);
+	}
 
-		std::string::size_type comma_pos = line.find(',');
-		if (comma_pos == std::string::npos || line.find(',', comma_pos + 1) != std::string::npos)
-			throw BadInputException("Error: invalid database line format at line " +
-				to_string_int(line_number) +
-				": " + line);
+	_stats.lap(STAGE_DB_PARSE, stage_start);
 
-		std::string date = trim(line.substr(0, comma_pos));
-		std::string value = trim(line.substr(comma_pos + 1));
+	merge_runs(job.days, job.rates, job.columns);
+	const std::vector<double> &rows = job.rates[0];
+	std::size_t count = job.days[0].size();
+	std::vector<RateColumn> columns(names.size());
+	for (std::size_t c = 0; c < columns.size(); ++c)
+	{
+		std::vector<double> rates(count);
+		for (std::size_t i = 0; i < count; ++i)
+			rates[i] = rows[i * job.columns + c];
+		columns[c].name = names[c];
+		columns[c].rates.swap(rates);
+	}
+	_days.swap(job.days[0]);
+	_columns.swap(columns);
+	MappedFile unused;
+	_snapshot.swap(unused);
+	remember_source(input, source);
+	_stats.lap(STAGE_DB_MERGE, stage_start);
 
-		validate_date(date, line_number);
-		_db[date] = parse_double_value(value, line_number);
+	if (have_source)
+	{
+		std::vector<const double *> column_rates;
+		for (std::size_t c = 0; c < _columns.size(); ++c)
+			column_rates.push_back(_columns[c].rates.begin());
+		write_snapshot(snapshot_file, source, names, _days.begin(), _days.size(), column_rates);
+		_stats.lap(STAGE_DB_SNAPSHOT_WRITE, stage_start);
 	}
+}
+
+// How much of data.csv before the indexed end an append must leave intact.
+static const std::size_t source_window = 1 << 16;
 
+static uint64_t window_hash(const char *begin, std::size_t bytes)
+{
+	std::size_t from = bytes > source_window ? bytes - source_window : 0;
+	return checksum(checksum_seed, begin + from, bytes - from);
 }
 
-void BitcoinExchange::print_all(std::string file)
+// Records how far into data.csv the index goes (up to the last complete
+// line) and what the file looked like then, so a later reload can tell a
+// pure append from a rewrite. Only a server ever reloads; other runs skip
+// the hash and leave bytes at 0, which forces a full reload.
+void BitcoinExchange::remember_source(const MappedFile &input, const struct stat &source)
 {
-	std::ifstream input(file.c_str());
-	if (!input.is_open())
-		throw FileOpenException("Error: could not open input file: " + file);
+	_source = DbSource();
+	if (!_options.serve && _options.socket_path.empty())
+		return;
+	const char *end = input.end();
+	while (end != input.begin() && end[-1] != '\n')
+		--end;
+	if (end == input.begin())
+		end = input.end();
+	_source.bytes = end - input.begin();
+	_source.size = source.st_size;
+	_source.inode = source.st_ino;
+	_source.mtime_sec = source.st_mtim.tv_sec;
+	_source.mtime_nsec = source.st_mtim.tv_nsec;
+	_source.window_hash = window_hash(input.begin(), _source.bytes);
+}
 
-	std::string line;
-	if (!std::getline(input, line))
-		throw BadInputException("Error: input file is empty");
+// Works out how data.csv changed since it was indexed, reading only the
+// window before the indexed end and what follows it. For an append of rows
+// dated after the current last date, parses them into append; a rewrite
+// (another file, a shorter one, a same-length edit, a changed window or an
+// out-of-order row) asks for a full reload. An invalid new row throws the
+// loader's usual error. Reads the index without changing it, so it may run
+// on another thread while lookups go on.
+ReloadKind BitcoinExchange::scan_appended(DbAppend &append) const
+{
+	const std::string db_file = "data.csv";
+	struct stat source;
+	if (stat(db_file.c_str(), &source) != 0 || _source.bytes == 0 || source.st_ino != _source.inode
+		|| static_cast<std::size_t>(source.st_size) < _source.bytes)
+		return RELOAD_FULL;
+	bool same_time = source.st_mtim.tv_sec == _source.mtime_sec && source.st_mtim.tv_nsec == _source.mtime_nsec;
+	if (static_cast<std::size_t>(source.st_size) == _source.size)
+		return same_time ? RELOAD_NONE : RELOAD_FULL;
+	MappedFile input;
+	if (!input.open(db_file) || input.size() < _source.bytes
+		|| window_hash(input.begin(), _source.bytes) != _source.window_hash)
+		return RELOAD_FULL;
+
+	const char *begin = input.begin() + _source.bytes;
+	const char *end = input.end();
+	while (end != begin && end[-1] != '\n')
+		--end;
 
-	while (std::getline(input, line))
+	append.source = _source;
+	append.source.size = input.size();
+	append.source.mtime_sec = source.st_mtim.tv_sec;
+	append.source.mtime_nsec = source.st_mtim.tv_nsec;
+	append.days.clear();
+	std::size_t columns = _columns.size();
+	append.rates.assign(columns, std::vector<double>());
+	append.whole = _days.viewing() && begin != end;
+	if (append.whole)
 	{
-		std::string trimmed = trim(line);
-		if (trimmed.empty())
-			continue;
+		append.days.assign(_days.begin(), _days.end());
+		for (std::size_t c = 0; c < columns; ++c)
+			append.rates[c].assign(_columns[c].rates.begin(), _columns[c].rates.end());
+	}
+	if (begin == end)
+		return RELOAD_APPEND;
 
-		try
-		{
-			std::string::iterator pipe_iter = std::find(line.begin(), line.end(), '|');
-			if (pipe_iter == line.end())
-				throw BadInputException("");
+	if (append.source.lines < 0)
+		append.source.lines = std::count(input.begin(), begin, '\n');
+	int line_number = append.source.lines;
+	uint32_t last = _days.empty() ? 0 : _days.back();
+	bool first = _days.empty();
+	std::vector<double> row(columns);
+	for (const char *cursor = begin; cursor < end; cursor = next_line(cursor, end) + 1)
+	{
+		uint32_t day;
+		parse_db_line(cursor, next_line(cursor, end), ++line_number, columns, day, &row[0]);
+		if (!first && day <= last)
+			return RELOAD_FULL;
+		append.days.push_back(day);
+		for (std::size_t c = 0; c < columns; ++c)
+			append.rates[c].push_back(row[c]);
+		last = day;
+		first = false;
+	}
+	append.source.bytes = end - input.begin();
+	append.source.window_hash = window_hash(input.begin(), append.source.bytes);
+	append.source.lines = line_number;
+	return RELOAD_APPEND;
+}
 
-			std::string::size_type pipe_pos = pipe_iter - line.begin();
-			if (std::find(pipe_iter + 1, line.end(), '|') != line.end())
-				throw BadInputException("");
+// Indexes rows scan_appended() parsed: the arrays grow by the new rows and
+// the dense and range tables are extended over them only.
+void BitcoinExchange::apply_appended(DbAppend &append)
+{
+	std::size_t indexed = _days.size();
+	if (append.whole)
+	{
+		_days.swap(append.days);
+		for (std::size_t c = 0; c < _columns.size(); ++c)
+			_columns[c].rates.swap(append.rates[c]);
+		MappedFile unused;
+		_snapshot.swap(unused);
+	}
+	else if (!append.days.empty())
+	{
+		_days.append(&append.days[0], &append.days[0] + append.days.size());
+		for (std::size_t c = 0; c < _columns.size(); ++c)
+			_columns[c].rates.append(&append.rates[c][0], &append.rates[c][0] + append.rates[c].size());
+	}
+	_source = append.source;
+	if (_days.size() == indexed)
+		return;
+	if (_options.dense)
+		build_dense(indexed);
+	pthread_mutex_lock(&_ranges_lock);
+	if (_ranges_built)
+		build_aggregates(indexed);
+	pthread_mutex_unlock(&_ranges_lock);
+}
 
-			std::string date = trim(line.substr(0, pipe_pos));
-			std::string amount_token = trim(line.substr(pipe_pos + 1));
+// A new exchange loaded from data.csv with the same options, built aside so
+// that this one keeps serving until it is swapped in.
+BitcoinExchange *BitcoinExchange::reloaded() const
+{
+	return new BitcoinExchange(_options);
+}
 
-			validate_date(date, 0);
-			double amount = parse_amount(amount_token, 0);
+// The row in effect on each calendar day from the first to the last
+// database date, gaps carrying the previous row forward. It holds row
+// indexes rather than rates so that every asset shares it. Dates are capped
+// at 2026, so the table is at most a few MB whatever the database length.
+void BitcoinExchange::build_dense(std::size_t first)
+{
+	if (first == 0 || _dense_rows.empty())
+	{
+		_dense_rows.clear();
+		first = 0;
+	}
+	if (_days.empty())
+		return;
 
-			std::map<std::string, double>::iterator it = _db.lower_bound(date);
-			if (it == _db.end() || it->first != date)
+	// Rows from first on only add days past the end of the table; the row
+	// before them now also covers the gap up to the first new day.
+	_dense_rows.resize(_days.back() - _days.front() + 1);
+	for (std::size_t i = (first == 0) ? 0 : first - 1; i < _days.size(); ++i)
+	{
+		std::size_t from = _days[i] - _days.front();
+		std::size_t to = (i + 1 < _days.size()) ? _days[i + 1] - _days.front() : _dense_rows.size();
+		std::fill(_dense_rows.begin() + from, _dense_rows.begin() + to, static_cast<uint32_t>(i));
+	}
+}
+
+const std::size_t BitcoinExchange::aggregate_block;
+
+// Range structures over each column's sorted rates: prefix sums (kept in
+// long double so that differences of large prefixes stay accurate) for sum
+// and avg, and a sparse table of per-block minima and maxima for min and
+// max. Blocks of 32 rows keep the table small; a query scans at most two
+// partial blocks and answers the full blocks in between with two table
+// lookups.
+void BitcoinExchange::build_aggregates(std::size_t first) const
+{
+	_ranges.resize(_columns.size());
+	for (std::size_t c = 0; c < _columns.size(); ++c)
+	{
+		RangeIndex &column = _ranges[c];
+		const RowArray<double> &rates = _columns[c].rates;
+		std::size_t count = rates.size();
+		if (first == 0)
+		{
+			column.prefix.assign(1, 0.0L);
+			column.block_min.clear();
+			column.block_max.clear();
+		}
+		column.prefix.resize(count + 1);
+		for (std::size_t i = first; i < count; ++i)
+			column.prefix[i + 1] = column.prefix[i] + rates[i];
+
+		// Only blocks from the one holding row first change, and on each
+		// level only the entries whose span reaches them.
+		std::size_t blocks = (count + aggregate_block - 1) / aggregate_block;
+		std::size_t changed = first / aggregate_block;
+		column.block_min.resize(std::max<std::size_t>(column.block_min.size(), 1));
+		column.block_max.resize(column.block_min.size());
+		column.block_min[0].resize(blocks);
+		column.block_max[0].resize(blocks);
+		for (std::size_t b = changed; b < blocks; ++b)
+		{
+			std::size_t row = b * aggregate_block;
+			std::size_t last = std::min(row + aggregate_block, count);
+			column.block_min[0][b] = *std::min_element(rates.begin() + row, rates.begin() + last);
+			column.block_max[0][b] = *std::max_element(rates.begin() + row, rates.begin() + last);
+		}
+		std::size_t level = 1;
+		for (std::size_t width = 2; width <= blocks; width *= 2, ++level)
+		{
+			if (column.block_min.size() == level)
+			{
+				column.block_min.resize(level + 1);
+				column.block_max.resize(level + 1);
+			}
+			const std::vector<double> &lower_min = column.block_min[level - 1];
+			const std::vector<double> &lower_max = column.block_max[level - 1];
+			std::vector<double> &level_min = column.block_min[level];
+			std::vector<double> &level_max = column.block_max[level];
+			level_min.resize(blocks - width + 1);
+			level_max.resize(blocks - width + 1);
+			for (std::size_t b = (changed >= width - 1) ? changed - width + 1 : 0; b + width <= blocks; ++b)
 			{
-				if (it == _db.begin())
-					throw BadInputException("");
-				--it;
+				level_min[b] = std::min(lower_min[b], lower_min[b + width / 2]);
+				level_max[b] = std::max(lower_max[b], lower_max[b + width / 2]);
 			}
+		}
+	}
+}
+
+// The tables cost O(rows) and only range queries use them, so they are
+// built on the first one rather than at load, which keeps startup from the
+// snapshot independent of history length. Every range query takes the
+// lock; it is uncontended once the tables exist.
+void BitcoinExchange::require_aggregates() const
+{
+	pthread_mutex_lock(&_ranges_lock);
+	if (!_ranges_built)
+	{
+		build_aggregates(0);
+		_ranges_built = true;
+	}
+	pthread_mutex_unlock(&_ranges_lock);
+}
+
+void BitcoinExchange::range_extrema(std::size_t asset, std::size_t first, std::size_t last,
+	double &low, double &high) const
+{
+	const RangeIndex &column = _ranges[asset];
+	const RowArray<double> &rates = _columns[asset].rates;
+	low = rates[first];
+	high = rates[first];
+	std::size_t first_block = (first + aggregate_block - 1) / aggregate_block;
+	std::size_t end_block = (last + 1) / aggregate_block;
+	if (first_block >= end_block)
+	{
+		for (std::size_t i = first; i <= last; ++i)
+		{
+			low = std::min(low, rates[i]);
+			high = std::max(high, rates[i]);
+		}
+		return;
+	}
+
+	for (std::size_t i = first; i < first_block * aggregate_block; ++i)
+	{
+		low = std::min(low, rates[i]);
+		high = std::max(high, rates[i]);
+	}
+	for (std::size_t i = end_block * aggregate_block; i <= last; ++i)
+	{
+		low = std::min(low, rates[i]);
+		high = std::max(high, rates[i]);
+	}
+	std::size_t level = 0;
+	while ((static_cast<std::size_t>(2) << level) <= end_block - first_block)
+		++level;
+	std::size_t second = end_block - (static_cast<std::size_t>(1) << level);
+	low = std::min(low, std::min(column.block_min[level][first_block], column.block_min[level][second]));
+	high = std::max(high, std::max(column.block_max[level][first_block], column.block_max[level][second]));
+}
+
+// Aggregates the query's asset over the database rows dated within
+// [day, last_day] into query.rate; false when no row falls in the range.
+bool BitcoinExchange::aggregate_range(Query &query) const
+{
+	std::size_t first = std::lower_bound(_days.begin(), _days.end(), query.day) - _days.begin();
+	std::size_t end = std::upper_bound(_days.begin(), _days.end(), query.last_day) - _days.begin();
+	if (first >= end)
+		return false;
+
+	require_aggregates();
+	const RangeIndex &column = _ranges[query.asset];
+	double low;
+	double high;
+	switch (query.aggregate)
+	{
+	case AGG_AVG:
+		query.rate = static_cast<double>((column.prefix[end] - column.prefix[first]) / (end - first));
+		break;
+	case AGG_MIN:
+		range_extrema(query.asset, first, end - 1, low, high);
+		query.rate = low;
+		break;
+	case AGG_MAX:
+		range_extrema(query.asset, first, end - 1, low, high);
+		query.rate = high;
+		break;
+	default:
+		query.rate = static_cast<double>(column.prefix[end] - column.prefix[first]);
+		break;
+	}
+	return true;
+}
+
+// Index of the last row dated on or before day, i.e. the closest earlier
+// rates. The loop has a fixed trip count and no data-dependent branch.
+bool BitcoinExchange::find_row(uint32_t day, std::size_t &row) const
+{
+	std::size_t count = _days.size();
+	if (count == 0 || day < _days[0])
+		return false;
+
+	if (!_dense_rows.empty())
+	{
+		row = _dense_rows[std::min<std::size_t>(day - _days[0], _dense_rows.size() - 1)];
+		return true;
+	}
+
+	const uint32_t *base = &_days[0];
+	while (count > 1)
+	{
+		std::size_t half = count / 2;
+		base = (base[half] <= day) ? base + half : base;
+		count -= half;
+	}
+	row = base - &_days[0];
+	return true;
+}
 
-			double result = amount * it->second;
-			std::cout << date << " => " << amount_token << " = " << result << std::endl;
+// "FROM .. TO" on the date side of a line selects a range query.
+bool parse_range(const char *begin, const char *end, Query &query)
+{
+	const char *dots = NULL;
+	for (const char *p = begin; p + 1 < end; ++p)
+	{
+		if (p[0] == '.' && p[1] == '.')
+		{
+			dots = p;
+			break;
 		}
-		catch (const InvalidValueException &e)
+	}
+	if (dots == NULL)
+		return false;
+
+	query.kind = QUERY_RANGE;
+	const char *from_begin = begin;
+	const char *from_end = dots;
+	const char *to_begin = dots + 2;
+	const char *to_end = end;
+	trim_range(from_begin, from_end);
+	trim_range(to_begin, to_end);
+	if (check_date(from_begin, from_end, query.day) != DATE_OK
+		|| check_date(to_begin, to_end, query.last_day) != DATE_OK
+		|| query.day > query.last_day)
+		return true;
+
+	query.date.assign(from_begin, from_end);
+	query.date.append(" .. ", 4);
+	query.date.append(to_begin, to_end);
+	query.status = LINE_OK;
+	return true;
+}
+
+Aggregate parse_aggregate(const char *begin, const char *end)
+{
+	std::string name(begin, end);
+	if (name == "sum")
+		return AGG_SUM;
+	if (name == "avg")
+		return AGG_AVG;
+	if (name == "min")
+		return AGG_MIN;
+	if (name == "max")
+		return AGG_MAX;
+	return AGG_AMOUNT;
+}
+
+// Takes a trailing asset name off the amount side ("3 ETH", "avg ETH");
+// without one the query uses the first rate column. False for a name the
+// database does not have.
+bool parse_asset(const char *begin, const char *&end, const std::vector<RateColumn> &columns,
+	std::size_t &asset)
+{
+	asset = 0;
+	const char *name = end;
+	while (name != begin && !is_trim_space(name[-1]))
+		--name;
+	if (name == begin)
+		return true;
+
+	std::size_t length = end - name;
+	while (asset < columns.size()
+		&& (columns[asset].name.size() != length || std::memcmp(columns[asset].name.data(), name, length) != 0))
+		++asset;
+	if (asset == columns.size())
+		return false;
+	end = name;
+	while (end != begin && is_trim_space(end[-1]))
+		--end;
+	return true;
+}
+
+// Splits and validates one input line without throwing; the outcome is
+// left in query.status for print_query.
+void parse_query(const char *begin, const char *end, const std::vector<RateColumn> &columns, Query &query)
+{
+	const char *trimmed_begin = begin;
+	const char *trimmed_end = end;
+	trim_range(trimmed_begin, trimmed_end);
+	query.trimmed.assign(trimmed_begin, trimmed_end);
+	query.status = LINE_BAD_INPUT;
+	query.kind = QUERY_POINT;
+
+	const char *pipe = static_cast<const char *>(std::memchr(begin, '|', end - begin));
+	if (pipe == NULL || std::memchr(pipe + 1, '|', end - pipe - 1) != NULL)
+		return;
+
+	const char *date_begin = begin;
+	const char *date_end = pipe;
+	const char *amount_begin = pipe + 1;
+	const char *amount_end = end;
+	trim_range(date_begin, date_end);
+	trim_range(amount_begin, amount_end);
+	query.amount_token.assign(amount_begin, amount_end);
+	if (!parse_asset(amount_begin, amount_end, columns, query.asset))
+		return;
+
+	if (parse_range(date_begin, date_end, query))
+	{
+		if (query.status != LINE_OK)
+			return;
+		query.aggregate = parse_aggregate(amount_begin, amount_end);
+		if (query.aggregate != AGG_AMOUNT)
 		{
-			std::string msg = e.what();
-			if (msg.find("exceeds max") != std::string::npos)
-				std::cout << "Error: too large a number." << std::endl;
-			else if (msg.find("non-negative") != std::string::npos)
-				std::cout << "Error: not a positive number." << std::endl;
-			else
-				std::cout << "Error: bad input => " << trimmed << std::endl;
+			query.amount = 1.0;
+			return;
 		}
-		catch (const InvalidDateException &)
+		query.status = check_amount(amount_begin, amount_end, query.amount);
+		return;
+	}
+
+	query.date.assign(date_begin, date_end);
+	if (check_date(date_begin, date_end, query.day) != DATE_OK)
+		return;
+	query.status = check_amount(amount_begin, amount_end, query.amount);
+}
+
+void print_query(const Query &query, OutputBuffer &out)
+{
+	switch (query.status)
+	{
+	case LINE_OK:
+		out.append(query.date);
+		out.append(" => ", 4);
+		out.append(query.amount_token);
+		out.append(" = ", 3);
+		out.append_double(query.amount * query.rate);
+		break;
+	case LINE_TOO_LARGE:
+		out.append("Error: too large a number.", 26);
+		break;
+	case LINE_NOT_POSITIVE:
+		out.append("Error: not a positive number.", 29);
+		break;
+	default:
+		out.append("Error: bad input => ", 20);
+		out.append(query.trimmed);
+		break;
+	}
+	out.append('\n');
+}
+
+struct QueryOrder
+{
+	const std::vector<Query> &queries;
+	QueryOrder(const std::vector<Query> &values) : queries(values) {}
+	bool operator()(std::size_t a, std::size_t b) const
+	{
+		return queries[a].day < queries[b].day;
+	}
+};
+
+// Answers a block of parsed queries with one forward walk over the
+// database: the valid queries are visited in date order, so the database
+// cursor never moves backwards.
+void BitcoinExchange::answer_block(std::vector<Query> &queries, std::size_t count,
+	std::vector<std::size_t> &order) const
+{
+	order.clear();
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		if (queries[i].status != LINE_OK)
+			continue;
+		if (queries[i].kind == QUERY_RANGE)
 		{
-			std::cout << "Error: bad input => " << trimmed << std::endl;
+			if (!aggregate_range(queries[i]))
+				queries[i].status = LINE_BAD_INPUT;
 		}
-		catch (const BadInputException &)
+		else
+			order.push_back(i);
+	}
+	std::sort(order.begin(), order.end(), QueryOrder(queries));
+
+	std::size_t cursor = 0;
+	for (std::size_t i = 0; i < order.size(); ++i)
+	{
+		Query &query = queries[order[i]];
+		if (_days.empty() || query.day < _days[0])
 		{
-			std::cout << "Error: bad input => " << trimmed << std::endl;
+			query.status = LINE_BAD_INPUT;
+			continue;
 		}
+		while (cursor + 1 < _days.size() && _days[cursor + 1] <= query.day)
+			++cursor;
+		query.rate = _columns[query.asset].rates[cursor];
 	}
 }
 
-BitcoinExchange::BitcoinExchange(std::string file)
+void BitcoinExchange::print_batch(PipelinedReader &input, OutputBuffer &out)
 {
-	validate(file);
-	fill_db();
-	print_all(file);
+	const std::size_t block_size = 65536;
+	std::vector<Query> queries(block_size);
+	std::vector<std::size_t> order;
+	order.reserve(block_size);
+
+	bool more = true;
+	while (more)
+	{
+		std::size_t count = 0;
+		const char *begin;
+		const char *end;
+		while (count < block_size && (more = input.next_line(begin, end)))
+		{
+			const char *trimmed_begin = begin;
+			const char *trimmed_end = end;
+			trim_range(trimmed_begin, trimmed_end);
+			if (trimmed_begin == trimmed_end)
+				continue;
+			parse_line(begin, end, queries[count++]);
+		}
+
+		answer_block(queries, count, order);
+		for (std::size_t i = 0; i < count; ++i)
+			print_query(queries[i], out);
+		if (_stats.enabled)
+		{
+			for (std::size_t i = 0; i < count; ++i)
+				++_stats.outcomes[queries[i].status];
+		}
+	}
 }
 
-BitcoinExchange::BitcoinExchange(const BitcoinExchange& other)
+struct ChunkJob
 {
-	*this = other;
+	const BitcoinExchange *exchange;
+	std::vector<const char *> bounds;
+	std::vector<std::string> output;
+	std::vector<unsigned long> outcomes;
+};
+
+void BitcoinExchange::parse_line(const char *begin, const char *end, Query &query) const
+{
+	parse_query(begin, end, _columns, query);
 }
 
-BitcoinExchange& BitcoinExchange::operator=(const BitcoinExchange& other)
+// Fills query.rate for a query parse_line accepted; false when the
+// database has no rate for it.
+bool BitcoinExchange::lookup(Query &query) const
 {
-	if (this != &other)
+	if (query.kind == QUERY_RANGE)
+		return aggregate_range(query);
+
+	std::size_t row;
+	if (!find_row(query.day, row))
+		return false;
+	query.rate = _columns[query.asset].rates[row];
+	return true;
+}
+
+// Answers one non-blank input line exactly as print_all would; query is
+// scratch space the caller keeps around to reuse its strings.
+void BitcoinExchange::answer_line(const char *begin, const char *end, Query &query, OutputBuffer &out) const
+{
+	parse_line(begin, end, query);
+	if (query.status == LINE_OK && !lookup(query))
+		query.status = LINE_BAD_INPUT;
+	print_query(query, out);
+}
+
+// Answers every non-blank line of [begin, end); outcomes, when given,
+// counts the lines per LineStatus.
+void BitcoinExchange::answer_range(const char *begin, const char *end, OutputBuffer &out,
+	unsigned long *outcomes) const
+{
+	Query query;
+	while (begin < end)
 	{
-		_db = other._db;
+		const char *line_end = next_line(begin, end);
+		const char *trimmed_begin = begin;
+		const char *trimmed_end = line_end;
+		trim_range(trimmed_begin, trimmed_end);
+		if (trimmed_begin != trimmed_end)
+		{
+			answer_line(begin, line_end, query, out);
+			if (outcomes != NULL)
+				++outcomes[query.status];
+		}
+		begin = line_end + 1;
 	}
-	return *this;
 }
 
-BitcoinExchange::~BitcoinExchange()
+void BitcoinExchange::answer_chunk(void *context, unsigned int index)
 {
+	ChunkJob *job = static_cast<ChunkJob *>(context);
+	OutputBuffer out(-1, 0);
+	unsigned long *outcomes = job->outcomes.empty() ? NULL : &job->outcomes[index * RunStats::outcome_count];
+	job->exchange->answer_range(job->bounds[index], job->bounds[index + 1], out, outcomes);
+	out.release(job->output[index]);
 }
 
-void validate_db(std::string db_file)
+// Splits the input after its header into newline-aligned chunks, answers
+// them on separate threads against the read-only index and writes the
+// per-chunk output back in file order.
+void BitcoinExchange::print_parallel(const std::string &file)
 {
-	if (db_file.size() < 4 || db_file.substr(db_file.size() - 4) != ".csv")
-		throw BadInputException("Error: database file must be a .csv file: " + db_file);
+	MappedFile input;
+	if (!input.open(file))
+		throw FileOpenException("Error: could not open input file: " + file);
+	if (input.size() == 0)
+		throw BadInputException("Error: input file is empty");
 
-	std::ifstream input(db_file.c_str());
-	if (!input.is_open())
-		throw FileOpenException("Error: could not open database file: " + db_file);
+	const char *data = next_line(input.begin(), input.end());
+	if (data != input.end())
+		++data;
 
-	std::string line;
-	int line_number = 0;
-	if (!std::getline(input, line))
-		throw BadInputException("Error: database file is empty");
-	++line_number;
+	unsigned int jobs = _options.jobs ? _options.jobs : hardware_threads();
+	ChunkJob job;
+	job.exchange = this;
+	job.bounds = split_lines(data, input.end(), jobs);
+	job.output.resize(jobs);
+	if (_stats.enabled)
+		job.outcomes.assign(jobs * RunStats::outcome_count, 0);
 
-	if (trim(line) != "date,exchange_rate")
-		throw BadInputException("Error: invalid database header");
+	run_parallel(jobs, answer_chunk, &job);
+	for (std::size_t i = 0; i < job.outcomes.size(); ++i)
+		_stats.outcomes[i % RunStats::outcome_count] += job.outcomes[i];
+	OutputBuffer out(STDOUT_FILENO);
+	for (unsigned int i = 0; i < jobs; ++i)
+		out.append(job.output[i]);
+}
 
-	while (std::getline(input, line))
+// The plain serial loop with every line's time split into reading,
+// validation, lookup and formatting. The clock reads cost a little per
+// line, which is why the untimed loop is kept separate.
+void BitcoinExchange::print_timed(PipelinedReader &input, OutputBuffer &out)
+{
+	Query query;
+	const char *begin;
+	const char *end;
+	double stage_start = _stats.start();
+	while (input.next_line(begin, end))
 	{
-		++line_number;
-		if (trim(line).empty())
-			throw BadInputException("Error: empty database line at line " + to_string_int(line_number));
+		_stats.lap(STAGE_INPUT_READ, stage_start);
+		const char *trimmed_begin = begin;
+		const char *trimmed_end = end;
+		trim_range(trimmed_begin, trimmed_end);
+		if (trimmed_begin == trimmed_end)
+			continue;
 
-		std::string::size_type comma_pos = line.find(',');
-		if (comma_pos == std::string::npos || line.find(',', comma_pos + 1) != std::string::npos)
-			throw BadInputException("Error: invalid database line format at line " +
-				to_string_int(line_number) +
-				": " + line);
+		parse_line(begin, end, query);
+		_stats.lap(STAGE_VALIDATE, stage_start);
+		if (query.status == LINE_OK)
+		{
+			if (!lookup(query))
+				query.status = LINE_BAD_INPUT;
+			_stats.lap(STAGE_LOOKUP, stage_start);
+		}
+		print_query(query, out);
+		++_stats.outcomes[query.status];
+		_stats.lap(STAGE_FORMAT, stage_start);
+	}
+	out.flush();
+	_stats.lap(STAGE_FORMAT, stage_start);
+}
 
-		std::string date = trim(line.substr(0, comma_pos));
-		std::string value = trim(line.substr(comma_pos + 1));
+void BitcoinExchange::print_all(std::string file)
+{
+	if (_options.jobs != 1 && !_options.batch)
+	{
+		StageTimer timer(_stats, STAGE_ANSWER);
+		print_parallel(file);
+		return;
+	}
+
+	// A reader thread keeps the next blocks of the file coming while lines
+	// are answered, so read latency overlaps with the work below.
+	PipelinedReader input;
+	if (!input.open(file))
+		throw FileOpenException("Error: could not open input file: " + file);
 
-		validate_date(date, line_number);
-		parse_double_value(value, line_number);
+	const char *begin;
+	const char *end;
+	if (!input.next_line(begin, end))
+		throw BadInputException("Error: input file is empty");
+
+	// Results are flushed when the buffer fills and when out goes out of
+	// scope, not per line.
+	OutputBuffer out(STDOUT_FILENO);
+	if (_options.batch)
+	{
+		StageTimer timer(_stats, STAGE_ANSWER);
+		print_batch(input, out);
+		out.flush();
+		return;
+	}
+	if (_stats.enabled)
+	{
+		print_timed(input, out);
+		return;
 	}
 
+	Query query;
+	while (input.next_line(begin, end))
+	{
+		const char *trimmed_begin = begin;
+		const char *trimmed_end = end;
+		trim_range(trimmed_begin, trimmed_end);
+		if (trimmed_begin == trimmed_end)
+			continue;
+
+		answer_line(begin, end, query, out);
+	}
+}
+
+BitcoinExchange::BitcoinExchange(std::string file) : _ranges_built(false)
+{
+	pthread_mutex_init(&_ranges_lock, NULL);
+	run(file);
+}
+
+BitcoinExchange::BitcoinExchange(std::string file, const ExchangeOptions &options)
+	: _options(options), _ranges_built(false)
+{
+	pthread_mutex_init(&_ranges_lock, NULL);
+	run(file);
 }
 
-void BitcoinExchange::validate(std::string inp_file)
+// Loads data.csv and builds the lookup structures without answering
+// anything, e.g. for a caller that drives parse_line and lookup itself.
+BitcoinExchange::BitcoinExchange(const ExchangeOptions &options)
+	: _options(options), _ranges_built(false)
 {
-	(void)inp_file;
-	std::string db_file = "data.csv";
-	validate_db(db_file);
-}
\ No newline at end of file
+	pthread_mutex_init(&_ranges_lock, NULL);
+	_stats.enabled = _options.stats;
+	load();
+}
+
+// The stage timings collected so far; all zero unless stats are enabled.
+const RunStats &BitcoinExchange::stats() const
+{
+	return _stats;
+}
+
+void BitcoinExchange::load()
+{
+	fill_db();
+	StageTimer timer(_stats, STAGE_DB_INDEX);
+	if (_options.dense)
+		build_dense(0);
+}
+
+// With --stats the summary goes to stderr on the way out, including when
+// the run stops on an error.
+void BitcoinExchange::run(const std::string &file)
+{
+	_stats.enabled = _options.stats;
+	try
+	{
+		execute(file);
+	}
+	catch (...)
+	{
+		if (_stats.enabled)
+			_stats.print();
+		throw;
+	}
+	if (_stats.enabled)
+		_stats.print();
+}
+
+void BitcoinExchange::execute(const std::string &file)
+{
+	load();
+
+	if (!_options.socket_path.empty())
+		QueryServer(*this).serve_socket(_options.socket_path);
+	else if (_options.serve)
+		QueryServer(*this).serve_stdio();
+	else
+		print_all(file);
+}
+
+BitcoinExchange::BitcoinExchange(const BitcoinExchange& other) : _ranges_built(false)
+{
+	pthread_mutex_init(&_ranges_lock, NULL);
+	*this = other;
+}
+
+BitcoinExchange& BitcoinExchange::operator=(const BitcoinExchange& other)
+{
+	if (this != &other)
+	{
+		_options = other._options;
+		_stats = other._stats;
+		_days = other._days;
+		_columns = other._columns;
+		_dense_rows = other._dense_rows;
+		std::vector<RangeIndex>().swap(_ranges);
+		_ranges_built = false;
+		_source = other._source;
+	}
+	return *this;
+}
+
+BitcoinExchange::~BitcoinExchange()
+{
+	pthread_mutex_destroy(&_ranges_lock);
+}
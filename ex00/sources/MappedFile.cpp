@@ -0,0 +1,85 @@
+#include "MappedFile.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+MappedFile::MappedFile() : _data(NULL), _size(0), _mapped(false) {}
+
+MappedFile::~MappedFile()
+{
+	release();
+}
+
+void MappedFile::release()
+{
+	if (_mapped)
+		munmap(const_cast<char *>(_data), _size);
+	_data = NULL;
+	_size = 0;
+	_mapped = false;
+	_buffer.clear();
+}
+
+// Maps regular files read-only; anything mmap refuses (pipes, character
+// devices) is read into an owned buffer instead so callers see one view.
+bool MappedFile::open(const std::string &path)
+{
+	release();
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr != MAP_FAILED)
+		{
+			madvise(addr, st.st_size, MADV_SEQUENTIAL);
+			_data = static_cast<const char *>(addr);
+			_size = st.st_size;
+			_mapped = true;
+			::close(fd);
+			return true;
+		}
+	}
+
+	char chunk[65536];
+	ssize_t count;
+	while ((count = ::read(fd, chunk, sizeof(chunk))) > 0)
+		_buffer.insert(_buffer.end(), chunk, chunk + count);
+	::close(fd);
+	if (!_buffer.empty())
+	{
+		_data = &_buffer[0];
+		_size = _buffer.size();
+	}
+	return true;
+}
+
+// Exchanges mappings; views into either file stay valid, now owned by the
+// other object.
+void MappedFile::swap(MappedFile &other)
+{
+	std::swap(_data, other._data);
+	std::swap(_size, other._size);
+	std::swap(_mapped, other._mapped);
+	_buffer.swap(other._buffer);
+}
+
+const char *MappedFile::begin() const
+{
+	return _data;
+}
+
+const char *MappedFile::end() const
+{
+	return _data + _size;
+}
+
+std::size_t MappedFile::size() const
+{
+	return _size;
+}
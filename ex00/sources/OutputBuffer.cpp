@@ -0,0 +1,163 @@
+#include "OutputBuffer.hpp"
+#include <cmath>
+#include <cstdio>
+#include <unistd.h>
+
+OutputBuffer::OutputBuffer(int fd, std::size_t capacity) : _fd(fd), _capacity(capacity)
+{
+	_data.reserve(capacity + 64);
+}
+
+OutputBuffer::~OutputBuffer()
+{
+	flush();
+}
+
+void OutputBuffer::append(const char *data, std::size_t size)
+{
+	_data.append(data, size);
+	if (_fd >= 0 && _data.size() >= _capacity)
+		flush();
+}
+
+void OutputBuffer::append(const std::string &text)
+{
+	append(text.data(), text.size());
+}
+
+void OutputBuffer::append(char c)
+{
+	_data.push_back(c);
+	if (_fd >= 0 && _data.size() >= _capacity)
+		flush();
+}
+
+void OutputBuffer::append_double(double value)
+{
+	char text[32];
+	append(text, format_double(value, text));
+}
+
+void OutputBuffer::flush()
+{
+	if (_fd < 0)
+		return;
+	const char *data = _data.data();
+	std::size_t size = _data.size();
+	while (size > 0)
+	{
+		ssize_t written = ::write(_fd, data, size);
+		if (written <= 0)
+			break;
+		data += written;
+		size -= written;
+	}
+	_data.clear();
+}
+
+void OutputBuffer::release(std::string &target)
+{
+	target.swap(_data);
+	_data.clear();
+}
+
+static std::size_t write_digits(unsigned long value, int count, char *out)
+{
+	for (int i = count - 1; i >= 0; --i, value /= 10)
+		out[i] = '0' + value % 10;
+	return count;
+}
+
+// Same text as printf("%g") / the default std::ostream formatting, i.e. six
+// significant digits. The value is scaled by an exact power of ten and
+// rounded to a six-digit integer; values outside that range, non-finite
+// ones and scaled values too close to a rounding tie for the scaling error
+// to be ruled out go through snprintf instead.
+std::size_t format_double(double value, char *out)
+{
+	static const double powers_of_ten[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	if (!std::isfinite(value))
+		return snprintf(out, 32, "%g", value);
+
+	double original = value;
+	std::size_t length = 0;
+	if (std::signbit(value))
+	{
+		out[length++] = '-';
+		value = -value;
+	}
+	if (value == 0.0)
+	{
+		out[length++] = '0';
+		return length;
+	}
+
+	int exponent = static_cast<int>(std::floor(std::log10(value)));
+	int shift = 5 - exponent;
+	if (shift < -22 || shift > 22)
+		return snprintf(out, 32, "%g", original);
+	double scaled = (shift < 0) ? value / powers_of_ten[-shift] : value * powers_of_ten[shift];
+	if (scaled < 99999.5 || scaled >= 999999.5)
+		return snprintf(out, 32, "%g", original);
+	double fraction = scaled - std::floor(scaled);
+	if (std::fabs(fraction - 0.5) < 1e-6)
+		return snprintf(out, 32, "%g", original);
+
+	unsigned long digits = static_cast<unsigned long>(scaled + 0.5);
+
+	int kept = 6;
+	while (kept > 1 && digits % 10 == 0)
+	{
+		digits /= 10;
+		--kept;
+	}
+
+	if (exponent < -4 || exponent >= 6)
+	{
+		unsigned long lead = digits;
+		for (int i = 1; i < kept; ++i)
+			lead /= 10;
+		out[length++] = '0' + lead;
+		if (kept > 1)
+		{
+			out[length++] = '.';
+			length += write_digits(digits, kept - 1, out + length);
+		}
+		out[length++] = 'e';
+		out[length++] = exponent < 0 ? '-' : '+';
+		int magnitude = exponent < 0 ? -exponent : exponent;
+		length += write_digits(magnitude, magnitude >= 100 ? 3 : 2, out + length);
+	}
+	else if (exponent >= 0)
+	{
+		int integer_digits = exponent + 1;
+		if (kept <= integer_digits)
+		{
+			length += write_digits(digits, kept, out + length);
+			for (int i = kept; i < integer_digits; ++i)
+				out[length++] = '0';
+		}
+		else
+		{
+			unsigned long divisor = 1;
+			for (int i = integer_digits; i < kept; ++i)
+				divisor *= 10;
+			length += write_digits(digits / divisor, integer_digits, out + length);
+			out[length++] = '.';
+			length += write_digits(digits % divisor, kept - integer_digits, out + length);
+		}
+	}
+	else
+	{
+		out[length++] = '0';
+		out[length++] = '.';
+		for (int i = -1; i > exponent; --i)
+			out[length++] = '0';
+		length += write_digits(digits, kept, out + length);
+	}
+	return length;
+}
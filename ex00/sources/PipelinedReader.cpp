@@ -0,0 +1,181 @@
+#include "PipelinedReader.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+PipelinedReader::PipelinedReader(std::size_t buffer_size, std::size_t buffers)
+	: _fd(-1), _ring(buffers < 2 ? 2 : buffers), _filled(0), _drained(0), _stop(false),
+	_threaded(false), _current(NULL), _cursor(NULL), _end(NULL), _done(false)
+{
+	for (std::size_t i = 0; i < _ring.size(); ++i)
+	{
+		_ring[i].data.resize(buffer_size ? buffer_size : 1);
+		_ring[i].size = 0;
+		_ring[i].last = false;
+	}
+	pthread_mutex_init(&_lock, NULL);
+	pthread_cond_init(&_ready, NULL);
+	pthread_cond_init(&_space, NULL);
+}
+
+PipelinedReader::~PipelinedReader()
+{
+	close();
+	pthread_cond_destroy(&_space);
+	pthread_cond_destroy(&_ready);
+	pthread_mutex_destroy(&_lock);
+}
+
+void PipelinedReader::close()
+{
+	if (_threaded)
+	{
+		pthread_mutex_lock(&_lock);
+		_stop = true;
+		pthread_cond_signal(&_space);
+		pthread_mutex_unlock(&_lock);
+		pthread_join(_thread, NULL);
+		_threaded = false;
+	}
+	if (_fd >= 0)
+		::close(_fd);
+	_fd = -1;
+}
+
+// Starts the read-ahead thread; if none can be created, buffers are read
+// on demand by the caller instead.
+bool PipelinedReader::open(const std::string &path)
+{
+	close();
+	_fd = ::open(path.c_str(), O_RDONLY);
+	if (_fd < 0)
+		return false;
+
+	posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	_filled = 0;
+	_drained = 0;
+	_stop = false;
+	_current = NULL;
+	_cursor = NULL;
+	_end = NULL;
+	_done = false;
+	_carry.clear();
+	_threaded = pthread_create(&_thread, NULL, read_loop, this) == 0;
+	return true;
+}
+
+// One read() per buffer: a regular file fills it, a pipe hands over what
+// it has so far. False once the input is exhausted.
+bool PipelinedReader::fill(Buffer &buffer)
+{
+	ssize_t count;
+	do
+		count = ::read(_fd, &buffer.data[0], buffer.data.size());
+	while (count < 0 && errno == EINTR);
+	buffer.size = (count > 0) ? count : 0;
+	buffer.last = (count <= 0);
+	return !buffer.last;
+}
+
+void *PipelinedReader::read_loop(void *arg)
+{
+	PipelinedReader *reader = static_cast<PipelinedReader *>(arg);
+	bool more = true;
+	while (more)
+	{
+		pthread_mutex_lock(&reader->_lock);
+		while (reader->_filled - reader->_drained == reader->_ring.size() && !reader->_stop)
+			pthread_cond_wait(&reader->_space, &reader->_lock);
+		bool stop = reader->_stop;
+		pthread_mutex_unlock(&reader->_lock);
+		if (stop)
+			break;
+
+		more = reader->fill(reader->_ring[reader->_filled % reader->_ring.size()]);
+		pthread_mutex_lock(&reader->_lock);
+		++reader->_filled;
+		pthread_cond_signal(&reader->_ready);
+		pthread_mutex_unlock(&reader->_lock);
+	}
+	return NULL;
+}
+
+// Makes the next buffer in the ring current; false once the buffer that
+// ended the input has already been handed out.
+bool PipelinedReader::acquire()
+{
+	if (_done)
+		return false;
+
+	Buffer &buffer = _ring[_drained % _ring.size()];
+	if (_threaded)
+	{
+		pthread_mutex_lock(&_lock);
+		while (_filled == _drained)
+			pthread_cond_wait(&_ready, &_lock);
+		pthread_mutex_unlock(&_lock);
+	}
+	else
+		fill(buffer);
+
+	_current = &buffer;
+	_cursor = &buffer.data[0];
+	_end = _cursor + buffer.size;
+	_done = buffer.last;
+	return true;
+}
+
+// Gives the current buffer back to the reader thread.
+void PipelinedReader::release()
+{
+	if (_current == NULL)
+		return;
+	_current = NULL;
+	_cursor = NULL;
+	_end = NULL;
+	pthread_mutex_lock(&_lock);
+	++_drained;
+	pthread_cond_signal(&_space);
+	pthread_mutex_unlock(&_lock);
+}
+
+// Sets [begin, end) to the next line without its '\n'; the range stays
+// valid until the following call. A last line without '\n' still counts.
+bool PipelinedReader::next_line(const char *&begin, const char *&end)
+{
+	_carry.clear();
+	for (;;)
+	{
+		if (_cursor != _end)
+		{
+			const char *newline = static_cast<const char *>(std::memchr(_cursor, '\n', _end - _cursor));
+			if (newline != NULL)
+			{
+				if (_carry.empty())
+				{
+					begin = _cursor;
+					end = newline;
+				}
+				else
+				{
+					_carry.append(_cursor, newline);
+					begin = _carry.data();
+					end = begin + _carry.size();
+				}
+				_cursor = newline + 1;
+				return true;
+			}
+			_carry.append(_cursor, _end);
+		}
+		release();
+		if (!acquire())
+		{
+			if (_carry.empty())
+				return false;
+			begin = _carry.data();
+			end = begin + _carry.size();
+			return true;
+		}
+	}
+}
@@ -0,0 +1,417 @@
+#include "QueryServer.hpp"
+#include "OutputBuffer.hpp"
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <csignal>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <iostream>
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int)
+{
+	stop_requested = 1;
+}
+
+static unsigned long elapsed_ns(const struct timespec &start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) * 1000000000UL + now.tv_nsec - start.tv_nsec;
+}
+
+static int log2_bucket(unsigned long value)
+{
+	int bucket = 0;
+	while (value > 1 && bucket < 63)
+	{
+		value >>= 1;
+		++bucket;
+	}
+	return bucket;
+}
+
+QueryServer::Connection::Connection(int in, int out)
+	: in_fd(in), out_fd(out), closing(false), written(0)
+{
+}
+
+const std::size_t QueryServer::output_limit;
+
+QueryServer::QueryServer(BitcoinExchange &exchange)
+	: _exchange(&exchange), _owned(NULL), _listen_fd(-1), _watch_fd(-1), _reloading(false),
+	_reload_pending(false), _requests(0)
+{
+	_reload_fds[0] = -1;
+	_reload_fds[1] = -1;
+	std::memset(_latency, 0, sizeof(_latency));
+}
+
+QueryServer::~QueryServer()
+{
+	if (_reloading)
+	{
+		pthread_join(_reload_thread, NULL);
+		delete _reload.rebuilt;
+	}
+	delete _owned;
+	if (_reload_fds[0] >= 0)
+	{
+		close(_reload_fds[0]);
+		close(_reload_fds[1]);
+	}
+	while (!_connections.empty())
+		close_connection(_connections.size() - 1);
+	if (_listen_fd >= 0)
+	{
+		close(_listen_fd);
+		unlink(_socket_path.c_str());
+	}
+	if (_watch_fd >= 0)
+		close(_watch_fd);
+}
+
+// Watches the directory rather than the file so that editors replacing
+// data.csv through a rename are noticed too. The reload thread reports
+// through a pipe that the poll loop watches. Without inotify or the pipe
+// the server simply keeps serving what it loaded.
+void QueryServer::watch_database()
+{
+	if (pipe(_reload_fds) != 0)
+	{
+		_reload_fds[0] = -1;
+		return;
+	}
+	fcntl(_reload_fds[0], F_SETFL, fcntl(_reload_fds[0], F_GETFL) | O_NONBLOCK);
+	_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (_watch_fd < 0)
+		return;
+	if (inotify_add_watch(_watch_fd, ".", IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+	{
+		close(_watch_fd);
+		_watch_fd = -1;
+	}
+}
+
+void QueryServer::database_changed()
+{
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t count;
+	while ((count = read(_watch_fd, events, sizeof(events))) > 0)
+	{
+		for (ssize_t offset = 0; offset < count;)
+		{
+			const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(events + offset);
+			if (event->len > 0 && std::strcmp(event->name, "data.csv") == 0)
+				changed = true;
+			offset += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	if (!changed)
+		return;
+	if (_reloading)
+		_reload_pending = true;
+	else
+		start_reload();
+}
+
+// Runs on the reload thread. Only reads the current exchange, which the
+// poll loop leaves unchanged until finish_reload().
+void *QueryServer::reload_database(void *context)
+{
+	Reload &reload = *static_cast<Reload *>(context);
+	try
+	{
+		reload.kind = reload.exchange->scan_appended(reload.append);
+		if (reload.kind == RELOAD_FULL)
+			reload.rebuilt = reload.exchange->reloaded();
+	}
+	catch (const std::exception &e)
+	{
+		reload.kind = RELOAD_NONE;
+		reload.error = e.what();
+	}
+	char done = 0;
+	while (write(reload.notify_fd, &done, 1) < 0 && errno == EINTR)
+		;
+	return NULL;
+}
+
+void QueryServer::start_reload()
+{
+	_reload.exchange = _exchange;
+	_reload.kind = RELOAD_NONE;
+	_reload.rebuilt = NULL;
+	_reload.error.clear();
+	_reload.notify_fd = _reload_fds[1];
+	_reload_pending = false;
+	_reloading = pthread_create(&_reload_thread, NULL, reload_database, &_reload) == 0;
+	if (!_reloading)
+		std::cerr << "Error: could not start the database reload" << std::endl;
+}
+
+// Takes in what the reload thread produced: appended rows extend the
+// current index, a rebuilt exchange replaces it. A failed reload keeps
+// serving the previous data.
+void QueryServer::finish_reload()
+{
+	char done[16];
+	while (read(_reload_fds[0], done, sizeof(done)) > 0)
+		;
+	pthread_join(_reload_thread, NULL);
+	_reloading = false;
+	if (!_reload.error.empty())
+		std::cerr << _reload.error << std::endl;
+	if (_reload.kind == RELOAD_APPEND)
+		_exchange->apply_appended(_reload.append);
+	else if (_reload.kind == RELOAD_FULL && _reload.rebuilt != NULL)
+	{
+		delete _owned;
+		_owned = _reload.rebuilt;
+		_exchange = _owned;
+	}
+	_reload.rebuilt = NULL;
+	std::vector<uint32_t>().swap(_reload.append.days);
+	std::vector<std::vector<double> >().swap(_reload.append.rates);
+	if (_reload_pending)
+		start_reload();
+}
+
+// stdin and stdout stay blocking: they may be shared with other processes,
+// and with a single connection there is nobody else to stall.
+void QueryServer::serve_stdio()
+{
+	_connections.push_back(Connection(STDIN_FILENO, STDOUT_FILENO));
+	watch_database();
+	run();
+}
+
+void QueryServer::serve_socket(const std::string &path)
+{
+	struct sockaddr_un address;
+	if (path.size() >= sizeof(address.sun_path))
+		throw BadInputException("Error: socket path too long: " + path);
+
+	_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (_listen_fd < 0)
+		throw FileOpenException("Error: could not create socket: " + path);
+	std::memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	std::memcpy(address.sun_path, path.c_str(), path.size());
+	unlink(path.c_str());
+	if (bind(_listen_fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) != 0
+		|| listen(_listen_fd, 64) != 0)
+	{
+		close(_listen_fd);
+		_listen_fd = -1;
+		throw FileOpenException("Error: could not listen on socket: " + path);
+	}
+	_socket_path = path;
+	// A client hanging up mid-reply must not take the server down, and
+	// SIGINT/SIGTERM end the loop so the socket file is removed on the way out.
+	std::signal(SIGPIPE, SIG_IGN);
+	struct sigaction action;
+	std::memset(&action, 0, sizeof(action));
+	action.sa_handler = request_stop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	watch_database();
+	run();
+}
+
+// Stdio mode ends with its only connection; socket mode runs until SIGINT
+// or SIGTERM. Each connection has two poll entries, input then output; the
+// output one is unused (fd -1) when there is nothing to send or when both
+// directions share a socket, which then carries both events. The reload
+// pipe, the inotify descriptor and the listening socket follow.
+void QueryServer::run()
+{
+	std::vector<struct pollfd> fds;
+	while (!stop_requested && (_listen_fd >= 0 || !_connections.empty()))
+	{
+		fds.clear();
+		std::size_t connections = _connections.size();
+		for (std::size_t i = 0; i < connections; ++i)
+		{
+			const Connection &connection = _connections[i];
+			bool reading = !connection.closing && connection.output.size() - connection.written < output_limit;
+			bool writing = connection.written < connection.output.size();
+			struct pollfd input = {connection.in_fd, static_cast<short>(reading ? POLLIN : 0), 0};
+			struct pollfd output = {-1, POLLOUT, 0};
+			if (connection.in_fd == connection.out_fd)
+				input.events |= writing ? POLLOUT : 0;
+			else if (writing)
+				output.fd = connection.out_fd;
+			fds.push_back(input);
+			fds.push_back(output);
+		}
+		struct pollfd reload = {_reloading ? _reload_fds[0] : -1, POLLIN, 0};
+		fds.push_back(reload);
+		struct pollfd watch = {_watch_fd, POLLIN, 0};
+		fds.push_back(watch);
+		if (_listen_fd >= 0)
+		{
+			struct pollfd entry = {_listen_fd, POLLIN, 0};
+			fds.push_back(entry);
+		}
+
+		if (poll(&fds[0], fds.size(), -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw ValidationException("Error: poll failed");
+		}
+
+		if (_listen_fd >= 0 && (fds.back().revents & POLLIN))
+		{
+			int client = accept(_listen_fd, NULL, NULL);
+			if (client >= 0 && fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK) == 0)
+				_connections.push_back(Connection(client, client));
+			else if (client >= 0)
+				close(client);
+		}
+		if (fds[2 * connections].revents)
+			finish_reload();
+		if (fds[2 * connections + 1].revents)
+			database_changed();
+		for (std::size_t i = connections; i-- > 0;)
+		{
+			Connection &connection = _connections[i];
+			short input = fds[2 * i].revents;
+			if (!connection.closing && (fds[2 * i].events & POLLIN)
+				&& (input & (POLLIN | POLLHUP | POLLERR)) && !read_connection(connection))
+				connection.closing = true;
+			bool failed = (input & POLLERR) && !(fds[2 * i].events & POLLIN);
+			if (failed || !flush_connection(connection)
+				|| (connection.closing && connection.written == connection.output.size()))
+				close_connection(i);
+		}
+	}
+}
+
+// Answers every complete line that has arrived and queues the replies.
+// Returns false when the peer is done (end of input or "quit").
+bool QueryServer::read_connection(Connection &connection)
+{
+	char chunk[65536];
+	ssize_t count = read(connection.in_fd, chunk, sizeof(chunk));
+	if (count < 0 && (errno == EINTR || errno == EAGAIN))
+		return true;
+	if (count > 0)
+		connection.pending.append(chunk, count);
+
+	OutputBuffer out(-1);
+	const char *begin = connection.pending.data();
+	const char *end = begin + connection.pending.size();
+	const char *cursor = begin;
+	bool open = count > 0;
+	while (open)
+	{
+		const char *newline = static_cast<const char *>(std::memchr(cursor, '\n', end - cursor));
+		if (newline == NULL)
+			break;
+		open = answer(cursor, newline, out);
+		cursor = newline + 1;
+	}
+	// At end of input a last line without newline still gets its answer.
+	if (count <= 0 && cursor != end)
+	{
+		answer(cursor, end, out);
+		cursor = end;
+	}
+	connection.pending.erase(0, cursor - begin);
+
+	std::string replies;
+	out.release(replies);
+	if (connection.output.empty())
+		connection.output.swap(replies);
+	else
+		connection.output += replies;
+	return open;
+}
+
+// Writes as much queued output as the descriptor takes without blocking.
+// False when the peer is gone.
+bool QueryServer::flush_connection(Connection &connection)
+{
+	while (connection.written < connection.output.size())
+	{
+		ssize_t count = write(connection.out_fd, connection.output.data() + connection.written,
+			connection.output.size() - connection.written);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (count <= 0)
+			return false;
+		connection.written += count;
+	}
+	if (connection.written == connection.output.size())
+	{
+		connection.output.clear();
+		connection.written = 0;
+	}
+	else if (connection.written >= output_limit)
+	{
+		connection.output.erase(0, connection.written);
+		connection.written = 0;
+	}
+	return true;
+}
+
+bool QueryServer::answer(const char *begin, const char *end, OutputBuffer &out)
+{
+	const char *trimmed_begin = begin;
+	const char *trimmed_end = end;
+	trim_range(trimmed_begin, trimmed_end);
+	if (trimmed_begin == trimmed_end)
+		return true;
+	std::string command(trimmed_begin, trimmed_end);
+	if (command == "quit")
+		return false;
+	if (command == "stats")
+	{
+		print_stats(out);
+		return true;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	_exchange->answer_line(begin, end, _query, out);
+	++_latency[log2_bucket(elapsed_ns(start))];
+	++_requests;
+	return true;
+}
+
+void QueryServer::print_stats(OutputBuffer &out) const
+{
+	char text[96];
+	int length = snprintf(text, sizeof(text), "requests %lu\n", _requests);
+	out.append(text, length);
+	for (int bucket = 0; bucket < 64; ++bucket)
+	{
+		if (_latency[bucket] == 0)
+			continue;
+		unsigned long low = bucket == 0 ? 0 : 1UL << bucket;
+		unsigned long high = (bucket == 63 ? 0 : 1UL << (bucket + 1)) - 1;
+		length = snprintf(text, sizeof(text), "latency_ns %lu-%lu %lu\n", low, high, _latency[bucket]);
+		out.append(text, length);
+	}
+	out.append("end\n", 4);
+}
+
+void QueryServer::close_connection(std::size_t index)
+{
+	if (_connections[index].in_fd != STDIN_FILENO)
+		close(_connections[index].in_fd);
+	_connections.erase(_connections.begin() + index);
+}
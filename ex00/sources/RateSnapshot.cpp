@@ -0,0 +1,158 @@
+#include "RateSnapshot.hpp"
+#include "MappedFile.hpp"
+#include <cstring>
+#include <cstdio>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char snapshot_magic[8] = {'B', 'T', 'C', 'S', 'N', 'A', 'P', '\0'};
+static const uint32_t snapshot_version = 2;
+static const uint32_t snapshot_byte_order = 0x01020304;
+
+static std::size_t padded(std::size_t size)
+{
+	return (size + 7) & ~static_cast<std::size_t>(7);
+}
+
+// FNV-1a over 64-bit words, continuing from hash (checksum_seed to start).
+// A trailing partial word is zero-padded, so only the last piece of a
+// sequence may have a size that is not a multiple of 8.
+uint64_t checksum(uint64_t hash, const char *data, std::size_t size)
+{
+	std::size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		std::memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 1099511628211ULL;
+	}
+	if (i < size)
+	{
+		uint64_t word = 0;
+		std::memcpy(&word, data + i, size - i);
+		hash = (hash ^ word) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static bool write_all(int fd, const char *data, std::size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t written = ::write(fd, data, size);
+		if (written <= 0)
+			return false;
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+static void fill_source(SnapshotHeader &header, const struct stat &source)
+{
+	header.source_size = source.st_size;
+	header.source_mtime_sec = source.st_mtim.tv_sec;
+	header.source_mtime_nsec = source.st_mtim.tv_nsec;
+}
+
+bool read_snapshot(const std::string &path, const struct stat &source, bool verify,
+	MappedFile &file, SnapshotView &view)
+{
+	if (!file.open(path) || file.size() < sizeof(SnapshotHeader))
+		return false;
+
+	SnapshotHeader header;
+	std::memcpy(&header, file.begin(), sizeof(header));
+	SnapshotHeader expected;
+	fill_source(expected, source);
+	if (std::memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)) != 0
+		|| header.version != snapshot_version
+		|| header.byte_order != snapshot_byte_order
+		|| header.source_size != expected.source_size
+		|| header.source_mtime_sec != expected.source_mtime_sec
+		|| header.source_mtime_nsec != expected.source_mtime_nsec)
+		return false;
+
+	if (header.assets == 0 || header.count > file.size() || header.assets > file.size()
+		|| header.names_size > file.size())
+		return false;
+	std::size_t days_offset = padded(header.names_size);
+	std::size_t rates_offset = days_offset + padded(header.count * sizeof(uint32_t));
+	std::size_t payload_size = rates_offset + header.assets * header.count * sizeof(double);
+	if (file.size() != sizeof(header) + payload_size)
+		return false;
+	const char *payload = file.begin() + sizeof(header);
+	if (verify && checksum(checksum_seed, payload, payload_size) != header.checksum)
+		return false;
+
+	std::vector<std::string> read_names;
+	const char *name = payload;
+	const char *names_end = payload + header.names_size;
+	while (name < names_end)
+	{
+		const char *newline = static_cast<const char *>(std::memchr(name, '\n', names_end - name));
+		if (newline == NULL)
+			return false;
+		read_names.push_back(std::string(name, newline));
+		name = newline + 1;
+	}
+	if (read_names.size() != header.assets)
+		return false;
+
+	view.names.swap(read_names);
+	view.days = reinterpret_cast<const uint32_t *>(payload + days_offset);
+	view.rates = reinterpret_cast<const double *>(payload + rates_offset);
+	view.count = header.count;
+	return true;
+}
+
+bool write_snapshot(const std::string &path, const struct stat &source,
+	const std::vector<std::string> &names, const uint32_t *days, std::size_t count,
+	const std::vector<const double *> &columns)
+{
+	std::string name_data;
+	for (std::size_t i = 0; i < names.size(); ++i)
+		name_data += names[i] + '\n';
+
+	std::size_t days_offset = padded(name_data.size());
+	std::size_t rates_offset = days_offset + padded(count * sizeof(uint32_t));
+	std::vector<char> payload(rates_offset + columns.size() * count * sizeof(double), 0);
+	std::memcpy(&payload[0], name_data.data(), name_data.size());
+	if (count > 0)
+	{
+		std::memcpy(&payload[days_offset], days, count * sizeof(uint32_t));
+		for (std::size_t i = 0; i < columns.size(); ++i)
+			std::memcpy(&payload[rates_offset + i * count * sizeof(double)],
+				columns[i], count * sizeof(double));
+	}
+
+	SnapshotHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+	header.version = snapshot_version;
+	header.byte_order = snapshot_byte_order;
+	header.count = count;
+	header.assets = columns.size();
+	header.names_size = name_data.size();
+	fill_source(header, source);
+	header.checksum = payload.empty() ? checksum_seed : checksum(checksum_seed, &payload[0], payload.size());
+
+	// Write to a private name and rename so readers never see a partial file.
+	std::ostringstream tmp_name;
+	tmp_name << path << '.' << getpid() << ".tmp";
+	std::string tmp_path = tmp_name.str();
+	int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	bool ok = write_all(fd, reinterpret_cast<const char *>(&header), sizeof(header));
+	if (ok && !payload.empty())
+		ok = write_all(fd, &payload[0], payload.size());
+	ok = (::close(fd) == 0) && ok;
+	if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+	{
+		std::remove(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,100 @@
+#include "RunStats.hpp"
+#include <cstdio>
+#include <time.h>
+
+static const char *const stage_names[STAGE_COUNT] = {
+	"db open",
+	"db snapshot read",
+	"db parse",
+	"db merge",
+	"db snapshot write",
+	"db index",
+	"input read",
+	"validate",
+	"lookup",
+	"format+write",
+	"answer"
+};
+
+// Same order as LineStatus.
+static const char *const outcome_names[RunStats::outcome_count] = {
+	"ok",
+	"bad input",
+	"not positive",
+	"too large"
+};
+
+const std::size_t RunStats::outcome_count;
+
+RunStats::RunStats() : enabled(false)
+{
+	for (int i = 0; i < STAGE_COUNT; ++i)
+	{
+		seconds[i] = 0.0;
+		runs[i] = 0;
+	}
+	for (std::size_t i = 0; i < outcome_count; ++i)
+		outcomes[i] = 0;
+}
+
+// A timestamp for lap(), or nothing when stats are off.
+double RunStats::start() const
+{
+	return enabled ? monotonic_seconds() : 0.0;
+}
+
+// Charges the time since the previous mark to stage and starts the next.
+void RunStats::lap(StatsStage stage, double &since)
+{
+	if (!enabled)
+		return;
+	double now = monotonic_seconds();
+	add(stage, now - since);
+	since = now;
+}
+
+void RunStats::add(StatsStage stage, double elapsed)
+{
+	seconds[stage] += elapsed;
+	++runs[stage];
+}
+
+// Stages that never ran are left out, e.g. the csv parse when the snapshot
+// was used, or the per-line split on the --batch and --jobs paths.
+void RunStats::print() const
+{
+	double total = 0.0;
+	for (int i = 0; i < STAGE_COUNT; ++i)
+	{
+		if (runs[i] == 0)
+			continue;
+		std::fprintf(stderr, "stats: %-18s %12.6f s\n", stage_names[i], seconds[i]);
+		total += seconds[i];
+	}
+	std::fprintf(stderr, "stats: %-18s %12.6f s\n", "total", total);
+
+	unsigned long lines = 0;
+	for (std::size_t i = 0; i < outcome_count; ++i)
+		lines += outcomes[i];
+	std::fprintf(stderr, "stats: %-18s %12lu\n", "lines", lines);
+	for (std::size_t i = 0; i < outcome_count; ++i)
+		std::fprintf(stderr, "stats:   %-16s %12lu\n", outcome_names[i], outcomes[i]);
+}
+
+double monotonic_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+StageTimer::StageTimer(RunStats &stats, StatsStage stage)
+	: _stats(stats), _stage(stage), _start(stats.enabled ? monotonic_seconds() : 0.0)
+{
+}
+
+StageTimer::~StageTimer()
+{
+	if (_stats.enabled)
+		_stats.add(_stage, monotonic_seconds() - _start);
+}
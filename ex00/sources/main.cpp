@@ -1,19 +1,85 @@
 #include "BitcoinExchange.hpp"
+#include <cstdlib>
 
-
+static void print_usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " [--dense] [--batch] [--jobs N] [--stats] [--verify] <input_file>" << std::endl;
+	std::cerr << "       " << name << " [--dense] --serve | --socket PATH" << std::endl;
+	std::cerr << "  --dense   index rates by calendar day for O(1) lookups" << std::endl;
+	std::cerr << "  --batch   answer input in sorted blocks with one database scan" << std::endl;
+	std::cerr << "  --jobs N  answer input on N threads (0 = one per core)" << std::endl;
+	std::cerr << "  --serve   answer queries from stdin until end of input" << std::endl;
+	std::cerr << "  --socket  answer queries from clients of a Unix socket" << std::endl;
+	std::cerr << "  --stats   print stage timings and line counts to stderr" << std::endl;
+	std::cerr << "  --verify  check the snapshot checksum before using it" << std::endl;
+}
 
 int main(int ac, char **av)
 {
-	if (ac != 2)
+	ExchangeOptions options;
+	const char *input_file = NULL;
+	int files = 0;
+
+	for (int i = 1; i < ac; ++i)
+	{
+		std::string arg = av[i];
+		if (arg == "--dense")
+			options.dense = true;
+		else if (arg == "--batch")
+			options.batch = true;
+		else if (arg == "--jobs")
+		{
+			char *end = NULL;
+			long jobs = (i + 1 < ac) ? std::strtol(av[i + 1], &end, 10) : -1;
+			if (jobs < 0 || jobs > 1024 || end == av[i + 1] || *end != '\0')
+			{
+				std::cerr << "Error: --jobs expects a thread count." << std::endl;
+				print_usage(av[0]);
+				return 1;
+			}
+			options.jobs = static_cast<unsigned int>(jobs);
+			++i;
+		}
+		else if (arg == "--serve")
+			options.serve = true;
+		else if (arg == "--stats")
+			options.stats = true;
+		else if (arg == "--verify")
+			options.verify = true;
+		else if (arg == "--socket")
+		{
+			if (i + 1 >= ac)
+			{
+				std::cerr << "Error: --socket expects a path." << std::endl;
+				print_usage(av[0]);
+				return 1;
+			}
+			options.socket_path = av[++i];
+		}
+		else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0)
+		{
+			std::cerr << "Error: unknown option: " << arg << std::endl;
+			print_usage(av[0]);
+			return 1;
+		}
+		else
+		{
+			input_file = av[i];
+			++files;
+		}
+	}
+
+	bool serving = options.serve || !options.socket_path.empty();
+	if (files != (serving ? 0 : 1))
 	{
 		std::cerr << "Error: wrong number of arguments." << std::endl;
-		std::cerr << "Usage: " << av[0] << " <input_file>" << std::endl;
+		print_usage(av[0]);
 		return 1;
 	}
 
 	try
 	{
-		BitcoinExchange exchange(av[1]);
+		BitcoinExchange exchange(input_file ? input_file : "", options);
 	}
 	catch (const std::exception &e)
 	{
@@ -22,4 +88,4 @@ int main(int ac, char **av)
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,184 @@
+#include "BitcoinExchange.hpp"
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Differential test of check_date against the per-character validator it
+// replaced: every YYYY-MM-DD from 0000-00-00 to 9999-99-99, then single-byte
+// corruptions, truncations and extensions of every valid date. Status and
+// day number must match in every case; the first mismatches are printed and
+// the exit status is 1 if there is any. Expected day numbers are not
+// computed but counted: the full enumeration visits valid dates in order,
+// so the nth one it meets is day n - 1.
+
+static int digits_to_int(const char *digits, int count)
+{
+	int value = 0;
+	for (int i = 0; i < count; ++i)
+		value = value * 10 + (digits[i] - '0');
+	return value;
+}
+
+static bool reference_leap_year(int year)
+{
+	return (year % 400 == 0) || (year % 4 == 0 && year % 100 != 0);
+}
+
+static DateStatus reference_check_date(const char *begin, const char *end, int &year, int &month, int &day)
+{
+	if (end - begin != 10 || begin[4] != '-' || begin[7] != '-')
+		return DATE_BAD_FORMAT;
+
+	for (int i = 0; i < 10; ++i)
+	{
+		if (i == 4 || i == 7)
+			continue;
+		if (!std::isdigit(static_cast<unsigned char>(begin[i])))
+			return DATE_BAD_FORMAT;
+	}
+
+	year = digits_to_int(begin, 4);
+	month = digits_to_int(begin + 5, 2);
+	day = digits_to_int(begin + 8, 2);
+
+	if (year < 1 || year > 2026 || month < 1 || month > 12)
+		return DATE_INVALID;
+
+	int month_days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+	if (reference_leap_year(year))
+		month_days[1] = 29;
+
+	if (day < 1 || day > month_days[month - 1])
+		return DATE_INVALID;
+	return DATE_OK;
+}
+
+struct DateCheck
+{
+	unsigned long cases;
+	unsigned long mismatches;
+	std::vector<uint32_t> day_numbers;
+	uint32_t next_day;
+};
+
+static const uint32_t unnumbered = 0xFFFFFFFFu;
+
+static void print_case(const char *date, std::size_t length)
+{
+	for (std::size_t i = 0; i < length; ++i)
+	{
+		unsigned char c = static_cast<unsigned char>(date[i]);
+		if (c >= 0x20 && c < 0x7F)
+			std::putchar(c);
+		else
+			std::printf("\\x%02X", c);
+	}
+}
+
+static void compare(DateCheck &check, const char *date, std::size_t length)
+{
+	uint32_t expected_days = 0;
+	uint32_t days = 0;
+	int year = 0;
+	int month = 0;
+	int day = 0;
+	DateStatus expected = reference_check_date(date, date + length, year, month, day);
+	if (expected == DATE_OK)
+	{
+		uint32_t &number = check.day_numbers[(year - 1) * 12 * 31 + (month - 1) * 31 + day - 1];
+		if (number == unnumbered)
+			number = check.next_day++;
+		expected_days = number;
+	}
+	DateStatus status = check_date(date, date + length, days);
+	++check.cases;
+	if (status == expected && (status != DATE_OK || days == expected_days))
+		return;
+	if (++check.mismatches <= 10)
+	{
+		std::printf("mismatch: \"");
+		print_case(date, length);
+		std::printf("\" status %d, expected %d; day %u, expected %u\n",
+			status, expected, days, expected_days);
+	}
+}
+
+static void write_date(char *date, int year, int month, int day)
+{
+	date[0] = '0' + year / 1000;
+	date[1] = '0' + year / 100 % 10;
+	date[2] = '0' + year / 10 % 10;
+	date[3] = '0' + year % 10;
+	date[4] = '-';
+	date[5] = '0' + month / 10;
+	date[6] = '0' + month % 10;
+	date[7] = '-';
+	date[8] = '0' + day / 10;
+	date[9] = '0' + day % 10;
+}
+
+// Every digit combination, valid or not, in calendar order; this numbers
+// the valid dates.
+static void check_all_digits(DateCheck &check)
+{
+	char date[10];
+	for (int year = 0; year <= 9999; ++year)
+		for (int month = 0; month <= 99; ++month)
+			for (int day = 0; day <= 99; ++day)
+			{
+				write_date(date, year, month, day);
+				compare(check, date, sizeof(date));
+			}
+}
+
+// Each valid date with one byte replaced by a byte that sits next to the
+// digit range in either nibble (every byte value on one date in 61), and
+// cut short or extended by one byte.
+static void check_corruptions(DateCheck &check)
+{
+	static const int month_days[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+	static const unsigned char near_digits[] = {0x00, 0x09, 0x0A, 0x20, 0x29, 0x2D, 0x2F,
+		0x3A, 0x3F, 0x40, 0x49, 0x70, 0x79, 0x80, 0xB0, 0xB9, 0xBA, 0xF0, 0xF9, 0xFF};
+	char date[11];
+	unsigned long count = 0;
+	for (int year = 1; year <= 2026; ++year)
+		for (int month = 1; month <= 12; ++month)
+			for (int day = 1; day <= month_days[month - 1]; ++day)
+			{
+				write_date(date, year, month, day);
+				bool every_byte = (count++ % 61 == 0);
+				std::size_t replacements = every_byte ? 256 : sizeof(near_digits);
+				for (std::size_t i = 0; i < 10; ++i)
+				{
+					char original = date[i];
+					for (std::size_t r = 0; r < replacements; ++r)
+					{
+						date[i] = static_cast<char>(every_byte ? r : near_digits[r]);
+						compare(check, date, 10);
+					}
+					for (char digit = '0'; digit <= '9'; ++digit)
+					{
+						date[i] = digit;
+						compare(check, date, 10);
+					}
+					date[i] = original;
+				}
+				compare(check, date, 9);
+				date[10] = '0';
+				compare(check, date, 11);
+			}
+}
+
+int main()
+{
+	DateCheck check;
+	check.cases = 0;
+	check.mismatches = 0;
+	check.day_numbers.assign(2026 * 12 * 31, unnumbered);
+	check.next_day = 0;
+	check_all_digits(check);
+	check_corruptions(check);
+	std::printf("date_check: %lu cases, %lu mismatches\n", check.cases, check.mismatches);
+	return check.mismatches == 0 ? 0 : 1;
+}
@@ -2,7 +2,7 @@
 #define RPN_HPP
 
 #include <iostream>
-#include <stack>
+#include <vector>
 #include <string>
 #include <sstream>
 #include <cmath>
@@ -20,10 +20,54 @@ public:
 	virtual ~RPNException() throw();
 };
 
+enum RPNOpcode
+{
+	RPN_PUSH,
+	RPN_ADD,
+	RPN_SUB,
+	RPN_MUL,
+	RPN_DIV,
+	RPN_LOAD,
+	RPN_STORE,
+	RPN_RECALL,
+	RPN_FAIL
+};
+
+struct RPNInstruction
+{
+	RPNOpcode op;
+	double value;
+};
+
+// A validated expression. Every check that does not depend on operand
+// values is done by RPN::compile; an expression that fails one compiles up
+// to the offending token and ends in RPN_FAIL, so that a division by zero
+// earlier in the expression is still the error reported, as it was when
+// tokens were checked one by one during evaluation. RPN_LOAD (a "$N"
+// column reference, value N - 1) only appears in programs compiled for
+// columnar evaluation; columns is then the highest N referenced.
+// RPN_STORE and RPN_RECALL only appear in programs from RPNOptimizer: STORE
+// copies the top of the stack to saved slot value, RECALL pushes it back.
+struct RPNProgram
+{
+	std::vector<RPNInstruction> code;
+	std::size_t max_depth;
+	std::size_t columns;
+	std::size_t saved;
+	std::string error;
+
+	RPNProgram();
+};
+
+class RPNJit;
+
 class RPN
 {
 private:
-	std::stack<double> _stack;
+	std::vector<double> _stack;
+	std::vector<double> _saved;
+	std::size_t _depth;
+	RPNProgram _program;
 	
 public:
 	RPN();
@@ -31,8 +75,19 @@ public:
 	RPN &operator=(RPN const &other);
 	~RPN();
 	
+	static const std::size_t max_columns = 4096;
+
+	static void compile(const char *begin, const char *end, RPNProgram &program, bool columns = false);
+	static RPNProgram compile(const std::string &expression);
+	const char *execute(const RPNProgram &program);
+	void run(const RPNProgram &program);
+	void run(const RPNJit &native);
 	void evaluate(const std::string &expression);
+	void evaluate(const char *begin, const char *end);
+	const char *try_evaluate(const char *begin, const char *end);
 	double getResult();
 };
 
+void append_number(std::string &out, double value);
+
 #endif
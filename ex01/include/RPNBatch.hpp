@@ -0,0 +1,43 @@
+#ifndef RPNBATCH_HPP
+#define RPNBATCH_HPP
+
+#include "RPN.hpp"
+#include <vector>
+#include <string>
+
+// Evaluates a stream of expressions, one per line, on a pool of threads
+// that each keep their own RPN. Input is read in large blocks; each block
+// is cut into one newline-aligned part per thread, and the parts' output
+// is written back in input order, one line per input line: the result, or
+// the error message for that expression.
+class RPNBatch
+{
+private:
+	unsigned int _jobs;
+	std::vector<RPN> _workers;
+	std::vector<const char *> _bounds;
+	std::vector<std::string> _output;
+	std::vector<unsigned long> _counts;
+	unsigned long _lines;
+	int _output_fd;
+
+	RPNBatch(const RPNBatch &other);
+	RPNBatch &operator=(const RPNBatch &other);
+	static void evaluate_part(void *context, unsigned int index);
+	bool evaluate_block(const char *begin, const char *end);
+	static bool consume_block(void *context, const char *begin, const char *end);
+public:
+	explicit RPNBatch(unsigned int jobs);
+	~RPNBatch();
+
+	bool run(int input_fd, int output_fd);
+	unsigned long lines() const;
+};
+
+// Receives each block read_blocks() reads; false stops the read.
+typedef bool (*BlockFunction)(void *context, const char *begin, const char *end);
+
+bool read_blocks(int fd, BlockFunction consume, void *context);
+bool write_all(int fd, const char *data, std::size_t size);
+
+#endif
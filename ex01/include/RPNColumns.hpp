@@ -0,0 +1,51 @@
+#ifndef RPNCOLUMNS_HPP
+#define RPNCOLUMNS_HPP
+
+#include "RPN.hpp"
+#include "RPNJit.hpp"
+#include <vector>
+#include <string>
+
+// Evaluates one expression over rows of comma-separated numbers, where "$N"
+// in the expression is field N of the row. Rows are gathered into batches
+// stored column by column, and each instruction runs over a whole batch at
+// once on SSE2 or AVX lanes (scalar without either), so dispatch is paid
+// once per batch rather than once per row. Output is one line per input
+// row: the result, or the first error for that row. With jit set, rows are
+// instead run one by one through native code for the program, when there
+// is a JIT for this platform.
+class RPNColumns
+{
+private:
+	static const std::size_t batch_rows = 1024;
+
+	RPNProgram _program;
+	RPNJit _native;
+	std::vector<double> _columns;
+	std::vector<double> _stack;
+	std::vector<double> _saved;
+	std::vector<const double *> _operands;
+	std::vector<const char *> _errors;
+	std::size_t _rows;
+	std::string _output;
+	unsigned long _lines;
+	int _output_fd;
+
+	RPNColumns(const RPNColumns &other);
+	RPNColumns &operator=(const RPNColumns &other);
+	void load_row(const char *begin, const char *end);
+	void divide(double *result, const double *dividend, const double *divisor, std::size_t count);
+	void evaluate_native();
+	void evaluate_lanes();
+	void evaluate_batch();
+	bool evaluate_block(const char *begin, const char *end);
+	static bool consume_block(void *context, const char *begin, const char *end);
+public:
+	RPNColumns(const std::string &expression, bool jit);
+	~RPNColumns();
+
+	bool run(int input_fd, int output_fd);
+	unsigned long lines() const;
+};
+
+#endif
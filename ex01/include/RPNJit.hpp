@@ -0,0 +1,35 @@
+#ifndef RPNJIT_HPP
+#define RPNJIT_HPP
+
+#include "RPN.hpp"
+#include <vector>
+
+// Native code for a compiled program, on Linux x86-64: SSE2 instructions in
+// an mmap'd page, with the stack kept in xmm registers and only slots past
+// the fifteenth spilled to memory. compile() returns false where there is
+// no JIT (other platforms, programs that fail to compile, a failed mmap);
+// callers then run the program on the interpreter instead.
+class RPNJit
+{
+private:
+	typedef int (*Function)(const double *columns, double *result);
+
+	void *_page;
+	std::size_t _page_size;
+	Function _function;
+	std::vector<unsigned char> _code;
+
+	RPNJit(const RPNJit &other);
+	RPNJit &operator=(const RPNJit &other);
+	void release();
+	void emit(const RPNProgram &program, std::size_t column_stride);
+public:
+	RPNJit();
+	~RPNJit();
+
+	bool compile(const RPNProgram &program, std::size_t column_stride = 1);
+	bool ready() const;
+	const char *execute(const double *columns, double &result) const;
+};
+
+#endif
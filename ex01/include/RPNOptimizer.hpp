@@ -0,0 +1,56 @@
+#ifndef RPNOPTIMIZER_HPP
+#define RPNOPTIMIZER_HPP
+
+#include "RPN.hpp"
+#include <map>
+#include <vector>
+
+// Rewrites a compiled program that will be run many times. The program is
+// rebuilt as a DAG in which identical subtrees share one node; operators
+// on two constants are folded, and a shared subtree is computed once, kept
+// with RPN_STORE and pushed again with RPN_RECALL. Results are unchanged
+// bit for bit. A division by a constant zero is reported at once: it is
+// reached on every run, and the only error a run can hit before it is
+// another division by zero, so the program becomes that error.
+class RPNOptimizer
+{
+private:
+	struct Node
+	{
+		RPNOpcode op;
+		double value;
+		std::size_t left;
+		std::size_t right;
+		std::size_t uses;
+		std::size_t slot;
+	};
+
+	struct Key
+	{
+		RPNOpcode op;
+		unsigned int bits[2];
+		std::size_t left;
+		std::size_t right;
+
+		bool operator<(const Key &other) const;
+	};
+
+	std::vector<Node> _nodes;
+	std::map<Key, std::size_t> _index;
+	std::vector<std::size_t> _stack;
+	std::vector<std::size_t> _pending;
+
+	RPNOptimizer(const RPNOptimizer &other);
+	RPNOptimizer &operator=(const RPNOptimizer &other);
+	std::size_t node(RPNOpcode op, double value, std::size_t left, std::size_t right);
+	bool build(const RPNProgram &program);
+	void count_uses(std::size_t root);
+	void emit(std::size_t root, RPNProgram &program);
+public:
+	RPNOptimizer();
+	~RPNOptimizer();
+
+	void optimize(RPNProgram &program);
+};
+
+#endif
@@ -0,0 +1,75 @@
+#include "Parallel.hpp"
+#include <pthread.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct ParallelSlot
+{
+	ParallelTask task;
+	void *context;
+	unsigned int index;
+	bool failed;
+	std::string error;
+};
+
+static void *run_slot(void *arg)
+{
+	ParallelSlot *slot = static_cast<ParallelSlot *>(arg);
+	try
+	{
+		slot->task(slot->context, slot->index);
+	}
+	catch (const std::exception &e)
+	{
+		slot->failed = true;
+		slot->error = e.what();
+	}
+	catch (...)
+	{
+		slot->failed = true;
+		slot->error = "Error: worker thread failed";
+	}
+	return NULL;
+}
+
+void run_parallel(unsigned int count, ParallelTask task, void *context)
+{
+	std::vector<ParallelSlot> slots(count);
+	std::vector<pthread_t> threads(count);
+	std::vector<bool> started(count, false);
+
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		slots[i].task = task;
+		slots[i].context = context;
+		slots[i].index = i;
+		slots[i].failed = false;
+	}
+	// Slot 0 runs on the calling thread; the others get their own, and fall
+	// back to the caller too if the system refuses to create a thread.
+	for (unsigned int i = 1; i < count; ++i)
+		started[i] = pthread_create(&threads[i], NULL, run_slot, &slots[i]) == 0;
+	if (count > 0)
+		run_slot(&slots[0]);
+	for (unsigned int i = 1; i < count; ++i)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			run_slot(&slots[i]);
+	}
+
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		if (slots[i].failed)
+			throw std::runtime_error(slots[i].error);
+	}
+}
+
+unsigned int hardware_threads()
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? static_cast<unsigned int>(count) : 1;
+}
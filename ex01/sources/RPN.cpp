@@ -1,4 +1,9 @@
 #include "RPN.hpp"
+#include "RPNJit.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
 
 RPNException::RPNException(const std::string &message) : _message(message) {}
 
@@ -9,62 +14,131 @@ const char *RPNException::what() const throw()
 
 RPNException::~RPNException() throw() {}
 
-std::string trim(const std::string &value)
+// C isspace: the characters operator>> splits tokens on.
+static bool is_space(char c)
 {
-	std::string::size_type start = value.find_first_not_of(" \t\r\n");
-	if (start == std::string::npos)
-		return "";
-	std::string::size_type end = value.find_last_not_of(" \t\r\n");
-	return value.substr(start, end - start + 1);
+	return c == ' ' || (c >= '\t' && c <= '\r');
 }
 
-bool is_number(const std::string &token)
+static bool is_digit(char c)
 {
-	if (token.empty())
-		return false;
-	std::string trimmed = trim(token);
-	if (trimmed.empty())
+	return c >= '0' && c <= '9';
+}
+
+// True when operator>>(double) would read all of [begin, end), i.e. it
+// matches [+-]?(digits[.digits*]|.digits)([eE][+-]?digits)?.
+static bool is_number(const char *begin, const char *end)
+{
+	const char *p = begin;
+	if (p != end && (*p == '+' || *p == '-'))
+		++p;
+	const char *digits = p;
+	while (p != end && is_digit(*p))
+		++p;
+	bool integer = (p != digits);
+	bool fraction = false;
+	if (p != end && *p == '.')
+	{
+		digits = ++p;
+		while (p != end && is_digit(*p))
+			++p;
+		fraction = (p != digits);
+	}
+	if (!integer && !fraction)
 		return false;
-	std::istringstream iss(trimmed);
-	double value;
-	char remaining;
-	if ((iss >> value) && !(iss >> remaining))
+	if (p != end && (*p == 'e' || *p == 'E'))
+	{
+		++p;
+		if (p != end && (*p == '+' || *p == '-'))
+			++p;
+		digits = p;
+		while (p != end && is_digit(*p))
+			++p;
+		if (p == digits)
+			return false;
+	}
+	return p == end;
+}
+
+// Converts a token is_number accepted. Like operator>>, rejects values
+// that overflow to infinity and keeps those that underflow. A single digit,
+// the usual token, needs no strtod; other tokens are copied to a stack
+// buffer for it unless they are very long.
+static bool number_value(const char *begin, const char *end, double &value)
+{
+	std::size_t length = end - begin;
+	if (length == 1)
 	{
-		// if (value < 0 || value >= 10)
-		// 	return false;
+		value = *begin - '0';
 		return true;
 	}
-	return false;
+
+	char buffer[64];
+	std::string long_token;
+	const char *text = buffer;
+	if (length < sizeof(buffer))
+	{
+		std::memcpy(buffer, begin, length);
+		buffer[length] = '\0';
+	}
+	else
+	{
+		long_token.assign(begin, end);
+		text = long_token.c_str();
+	}
+	value = std::strtod(text, NULL);
+	return value != HUGE_VAL && value != -HUGE_VAL;
 }
 
-bool is_operator(const std::string &token)
+// The opcode for a one-character operator token, RPN_FAIL for anything else.
+static RPNOpcode operator_code(const char *begin, const char *end)
 {
-	std::string trimmed = trim(token);
-	return trimmed == "+" || trimmed == "-" || trimmed == "*" || trimmed == "/";
+	if (end - begin != 1)
+		return RPN_FAIL;
+	switch (*begin)
+	{
+	case '+':
+		return RPN_ADD;
+	case '-':
+		return RPN_SUB;
+	case '*':
+		return RPN_MUL;
+	case '/':
+		return RPN_DIV;
+	default:
+		return RPN_FAIL;
+	}
 }
 
-double apply_operator(double a, double b, const std::string &op)
+// "$N" with N from 1 to RPN::max_columns; index is N - 1.
+static bool column_index(const char *begin, const char *end, double &index)
 {
-	if (op == "+")
-		return a + b;
-	else if (op == "-")
-		return a - b;
-	else if (op == "*")
-		return a * b;
-	else if (op == "/")
+	if (end - begin < 2 || *begin != '$')
+		return false;
+	std::size_t column = 0;
+	for (const char *p = begin + 1; p != end; ++p)
 	{
-		if (b == 0.0)
-			throw RPNException("Error: division by zero");
-		return a / b;
+		if (!is_digit(*p))
+			return false;
+		column = column * 10 + (*p - '0');
+		if (column > RPN::max_columns)
+			return false;
 	}
-	throw RPNException("Error: unknown operator");
+	if (column == 0)
+		return false;
+	index = static_cast<double>(column - 1);
+	return true;
 }
 
-RPN::RPN()
+RPNProgram::RPNProgram() : max_depth(0), columns(0), saved(0) {}
+
+const std::size_t RPN::max_columns;
+
+RPN::RPN() : _depth(0)
 {
 }
 
-RPN::RPN(RPN const &other)
+RPN::RPN(RPN const &other) : _depth(0)
 {
 	*this = other;
 }
@@ -78,54 +152,211 @@ RPN &RPN::operator=(RPN const &other)
 	if (this != &other)
 	{
 		_stack = other._stack;
+		_saved = other._saved;
+		_depth = other._depth;
+		_program = other._program;
 	}
 	return *this;
 }
 
-void RPN::evaluate(const std::string &expression)
+static void fail(RPNProgram &program, const char *message)
 {
-	std::istringstream iss(expression);
-	std::string token;
+	RPNInstruction instruction;
+	instruction.op = RPN_FAIL;
+	instruction.value = 0.0;
+	program.code.push_back(instruction);
+	program.error = message;
+}
 
-	while (iss >> token)
+// Scans and checks the expression once, in a single pass over its bytes
+// that allocates nothing but program storage (reused when program is).
+// The stack depth after every instruction is known here, so operand counts
+// are checked at compile time and the interpreter can size its stack up
+// front. Column references are only accepted when columns is set.
+void RPN::compile(const char *begin, const char *end, RPNProgram &program, bool columns)
+{
+	program.code.clear();
+	program.max_depth = 0;
+	program.columns = 0;
+	program.saved = 0;
+	program.error.clear();
+	std::size_t depth = 0;
+
+	const char *cursor = begin;
+	while (true)
 	{
-		token = trim(token);
-		if (token.empty())
-			continue;
+		while (cursor != end && is_space(*cursor))
+			++cursor;
+		if (cursor == end)
+			break;
+		const char *token = cursor;
+		while (cursor != end && !is_space(*cursor))
+			++cursor;
 
-		if (is_number(token))
+		RPNInstruction instruction;
+		instruction.value = 0.0;
+		if (columns && column_index(token, cursor, instruction.value))
+		{
+			instruction.op = RPN_LOAD;
+			if (static_cast<std::size_t>(instruction.value) >= program.columns)
+				program.columns = static_cast<std::size_t>(instruction.value) + 1;
+			if (++depth > program.max_depth)
+				program.max_depth = depth;
+		}
+		else if (is_number(token, cursor) && number_value(token, cursor, instruction.value))
 		{
-			std::istringstream num_stream(token);
-			double value;
-			if (!(num_stream >> value))
-				throw RPNException("Error: invalid number");
-			if (value < 0 || value >= 10)
-				throw RPNException("Error: number must be between 0 and 9");
-			_stack.push(value);
+			if (instruction.value < 0 || instruction.value >= 10)
+				return fail(program, "Error: number must be between 0 and 9");
+			instruction.op = RPN_PUSH;
+			if (++depth > program.max_depth)
+				program.max_depth = depth;
 		}
-		else if (is_operator(token))
+		else if ((instruction.op = operator_code(token, cursor)) != RPN_FAIL)
 		{
-			if (_stack.size() < 2)
-				throw RPNException("Error: insufficient operands");
-			
-			double b = _stack.top(); _stack.pop();
-			double a = _stack.top(); _stack.pop();
-			double result = apply_operator(a, b, token);
-			_stack.push(result);
+			if (depth < 2)
+				return fail(program, "Error: insufficient operands");
+			--depth;
 		}
 		else
+			return fail(program, "Error: invalid token");
+		program.code.push_back(instruction);
+	}
+
+	if (depth != 1)
+		fail(program, "Error: invalid expression");
+}
+
+RPNProgram RPN::compile(const std::string &expression)
+{
+	RPNProgram program;
+	compile(expression.data(), expression.data() + expression.size(), program);
+	return program;
+}
+
+// Runs a compiled program on a fresh stack; the program can be run any
+// number of times. Returns the error message, or NULL on success.
+const char *RPN::execute(const RPNProgram &program)
+{
+	if (_stack.size() < program.max_depth)
+		_stack.resize(program.max_depth);
+	if (_saved.size() < program.saved)
+		_saved.resize(program.saved);
+	_depth = 0;
+	double *top = _stack.empty() ? NULL : &_stack[0];
+
+	const RPNInstruction *code = program.code.empty() ? NULL : &program.code[0];
+	const RPNInstruction *end = code + program.code.size();
+	for (; code != end; ++code)
+	{
+		switch (code->op)
 		{
-			throw RPNException("Error: invalid token");
+		case RPN_PUSH:
+			*top++ = code->value;
+			break;
+		case RPN_ADD:
+			--top;
+			top[-1] = top[-1] + top[0];
+			break;
+		case RPN_SUB:
+			--top;
+			top[-1] = top[-1] - top[0];
+			break;
+		case RPN_MUL:
+			--top;
+			top[-1] = top[-1] * top[0];
+			break;
+		case RPN_DIV:
+			if (top[-1] == 0.0)
+				return "Error: division by zero";
+			--top;
+			top[-1] = top[-1] / top[0];
+			break;
+		case RPN_STORE:
+			_saved[static_cast<std::size_t>(code->value)] = top[-1];
+			break;
+		case RPN_RECALL:
+			*top++ = _saved[static_cast<std::size_t>(code->value)];
+			break;
+		case RPN_LOAD:
+			return "Error: column reference outside columnar mode";
+		case RPN_FAIL:
+			return program.error.c_str();
 		}
 	}
+	_depth = program.max_depth ? top - &_stack[0] : 0;
+	return NULL;
+}
 
-	if (_stack.size() != 1)
-		throw RPNException("Error: invalid expression");
+void RPN::run(const RPNProgram &program)
+{
+	const char *error = execute(program);
+	if (error != NULL)
+		throw RPNException(error);
 }
 
-double RPN::getResult()
+// run() for a program compiled by RPNJit, with the same errors.
+void RPN::run(const RPNJit &native)
 {
 	if (_stack.empty())
+		_stack.resize(1);
+	_depth = 0;
+	const char *error = native.execute(NULL, _stack[0]);
+	if (error != NULL)
+		throw RPNException(error);
+	_depth = 1;
+}
+
+void RPN::evaluate(const std::string &expression)
+{
+	evaluate(expression.data(), expression.data() + expression.size());
+}
+
+void RPN::evaluate(const char *begin, const char *end)
+{
+	compile(begin, end, _program);
+	run(_program);
+}
+
+// evaluate() without the exception, for callers where failing expressions
+// are routine: returns the error message, or NULL with the result ready in
+// getResult().
+const char *RPN::try_evaluate(const char *begin, const char *end)
+{
+	compile(begin, end, _program);
+	return execute(_program);
+}
+
+// Same text as std::cout << value with the default precision. Whole
+// numbers of up to six digits, most results of digit arithmetic, print
+// as plain integers under %g and skip snprintf.
+void append_number(std::string &out, double value)
+{
+	char text[32];
+	if (value > -1e6 && value < 1e6 && value == static_cast<long>(value)
+		&& !(value == 0.0 && std::signbit(value)))
+	{
+		long integer = static_cast<long>(value);
+		unsigned long digits = integer < 0 ? -integer : integer;
+		char *end = text + sizeof(text);
+		char *p = end;
+		do
+		{
+			*--p = static_cast<char>('0' + digits % 10);
+			digits /= 10;
+		}
+		while (digits != 0);
+		if (integer < 0)
+			*--p = '-';
+		out.append(p, end - p);
+		return;
+	}
+	int length = snprintf(text, sizeof(text), "%g", value);
+	out.append(text, length);
+}
+
+double RPN::getResult()
+{
+	if (_depth == 0)
 		throw RPNException("Error: no result");
-	return _stack.top();
+	return _stack[_depth - 1];
 }
@@ -0,0 +1,152 @@
+#include "RPNBatch.hpp"
+#include "Parallel.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+static const std::size_t block_size = 1 << 22;
+static const std::size_t min_part_size = 1 << 16;
+
+RPNBatch::RPNBatch(unsigned int jobs)
+	: _jobs(jobs ? jobs : 1), _workers(_jobs), _output(_jobs), _counts(_jobs, 0), _lines(0), _output_fd(-1)
+{
+}
+
+RPNBatch::~RPNBatch()
+{
+}
+
+unsigned long RPNBatch::lines() const
+{
+	return _lines;
+}
+
+// Reads fd to the end in blocks of whole lines, growing the buffer for a
+// line longer than a block, and passes each non-empty block to consume; only
+// the last block may lack its final newline. False on a read error or when
+// consume fails.
+bool read_blocks(int fd, BlockFunction consume, void *context)
+{
+	std::vector<char> buffer(block_size);
+	std::size_t filled = 0;
+	bool eof = false;
+
+	while (!eof)
+	{
+		if (filled == buffer.size())
+			buffer.resize(buffer.size() * 2);
+		ssize_t count = ::read(fd, &buffer[filled], buffer.size() - filled);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0)
+			return false;
+		eof = (count == 0);
+		filled += count;
+		if (!eof && filled < buffer.size())
+			continue;
+
+		const char *begin = &buffer[0];
+		const char *end = begin + filled;
+		if (!eof)
+		{
+			while (end != begin && end[-1] != '\n')
+				--end;
+			if (end == begin)
+				continue;
+		}
+		if (end != begin && !consume(context, begin, end))
+			return false;
+		filled -= end - begin;
+		std::memmove(&buffer[0], end, filled);
+	}
+	return true;
+}
+
+bool write_all(int fd, const char *data, std::size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t written = ::write(fd, data, size);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+void RPNBatch::evaluate_part(void *context, unsigned int index)
+{
+	RPNBatch *batch = static_cast<RPNBatch *>(context);
+	RPN &rpn = batch->_workers[index];
+	std::string &out = batch->_output[index];
+	const char *cursor = batch->_bounds[index];
+	const char *end = batch->_bounds[index + 1];
+	unsigned long count = 0;
+
+	out.clear();
+	while (cursor < end)
+	{
+		const char *line_end = static_cast<const char *>(std::memchr(cursor, '\n', end - cursor));
+		if (line_end == NULL)
+			line_end = end;
+		const char *error = rpn.try_evaluate(cursor, line_end);
+		if (error == NULL)
+			append_number(out, rpn.getResult());
+		else
+			out += error;
+		out += '\n';
+		++count;
+		cursor = line_end + 1;
+	}
+	batch->_counts[index] = count;
+}
+
+// Cuts [begin, end) into newline-aligned parts, evaluates them in parallel
+// and writes their output in order.
+bool RPNBatch::evaluate_block(const char *begin, const char *end)
+{
+	unsigned int parts = _jobs;
+	if (static_cast<std::size_t>(end - begin) / min_part_size < parts)
+		parts = (end - begin) / min_part_size + 1;
+
+	_bounds.clear();
+	_bounds.push_back(begin);
+	for (unsigned int i = 1; i < parts; ++i)
+	{
+		const char *split = begin + (end - begin) * i / parts;
+		if (split < _bounds.back())
+			split = _bounds.back();
+		if (split != begin && split[-1] != '\n')
+		{
+			const char *newline = static_cast<const char *>(std::memchr(split, '\n', end - split));
+			split = (newline == NULL) ? end : newline + 1;
+		}
+		_bounds.push_back(split);
+	}
+	_bounds.push_back(end);
+
+	run_parallel(parts, evaluate_part, this);
+	for (unsigned int i = 0; i < parts; ++i)
+	{
+		_lines += _counts[i];
+		if (!write_all(_output_fd, _output[i].data(), _output[i].size()))
+			return false;
+	}
+	return true;
+}
+
+bool RPNBatch::consume_block(void *context, const char *begin, const char *end)
+{
+	return static_cast<RPNBatch *>(context)->evaluate_block(begin, end);
+}
+
+// Evaluates input_fd to the end. False on a read or write error.
+bool RPNBatch::run(int input_fd, int output_fd)
+{
+	_output_fd = output_fd;
+	return read_blocks(input_fd, consume_block, this);
+}
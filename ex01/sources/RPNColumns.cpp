@@ -0,0 +1,295 @@
+#include "RPNColumns.hpp"
+#include "RPNBatch.hpp"
+#include "RPNOptimizer.hpp"
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// One vector register of rows: four doubles with AVX (-mavx or -mavx2),
+// two with SSE2, which every x86-64 build has, and a plain double
+// elsewhere. Batches are a multiple of every lane count, so loops run
+// whole registers and never need a scalar tail.
+#if defined(__AVX__)
+typedef __m256d Lanes;
+static const std::size_t lane_count = 4;
+static Lanes load_lanes(const double *p) { return _mm256_loadu_pd(p); }
+static void store_lanes(double *p, Lanes v) { _mm256_storeu_pd(p, v); }
+static Lanes broadcast_lanes(double value) { return _mm256_set1_pd(value); }
+static Lanes add_lanes(Lanes a, Lanes b) { return _mm256_add_pd(a, b); }
+static Lanes sub_lanes(Lanes a, Lanes b) { return _mm256_sub_pd(a, b); }
+static Lanes mul_lanes(Lanes a, Lanes b) { return _mm256_mul_pd(a, b); }
+static Lanes div_lanes(Lanes a, Lanes b) { return _mm256_div_pd(a, b); }
+static int zero_lanes(Lanes v) { return _mm256_movemask_pd(_mm256_cmp_pd(v, _mm256_setzero_pd(), _CMP_EQ_OQ)); }
+#elif defined(__SSE2__)
+typedef __m128d Lanes;
+static const std::size_t lane_count = 2;
+static Lanes load_lanes(const double *p) { return _mm_loadu_pd(p); }
+static void store_lanes(double *p, Lanes v) { _mm_storeu_pd(p, v); }
+static Lanes broadcast_lanes(double value) { return _mm_set1_pd(value); }
+static Lanes add_lanes(Lanes a, Lanes b) { return _mm_add_pd(a, b); }
+static Lanes sub_lanes(Lanes a, Lanes b) { return _mm_sub_pd(a, b); }
+static Lanes mul_lanes(Lanes a, Lanes b) { return _mm_mul_pd(a, b); }
+static Lanes div_lanes(Lanes a, Lanes b) { return _mm_div_pd(a, b); }
+static int zero_lanes(Lanes v) { return _mm_movemask_pd(_mm_cmpeq_pd(v, _mm_setzero_pd())); }
+#else
+typedef double Lanes;
+static const std::size_t lane_count = 1;
+static Lanes load_lanes(const double *p) { return *p; }
+static void store_lanes(double *p, Lanes v) { *p = v; }
+static Lanes broadcast_lanes(double value) { return value; }
+static Lanes add_lanes(Lanes a, Lanes b) { return a + b; }
+static Lanes sub_lanes(Lanes a, Lanes b) { return a - b; }
+static Lanes mul_lanes(Lanes a, Lanes b) { return a * b; }
+static Lanes div_lanes(Lanes a, Lanes b) { return a / b; }
+static int zero_lanes(Lanes v) { return v == 0.0; }
+#endif
+
+struct AddLanes { static Lanes apply(Lanes a, Lanes b) { return add_lanes(a, b); } };
+struct SubLanes { static Lanes apply(Lanes a, Lanes b) { return sub_lanes(a, b); } };
+struct MulLanes { static Lanes apply(Lanes a, Lanes b) { return mul_lanes(a, b); } };
+
+template <class Op>
+static void combine(double *result, const double *a, const double *b, std::size_t count)
+{
+	for (std::size_t row = 0; row < count; row += lane_count)
+		store_lanes(result + row, Op::apply(load_lanes(a + row), load_lanes(b + row)));
+}
+
+static void fill(double *result, double value, std::size_t count)
+{
+	Lanes lanes = broadcast_lanes(value);
+	for (std::size_t row = 0; row < count; row += lane_count)
+		store_lanes(result + row, lanes);
+}
+
+// A field as strtod reads it, surrounding blanks aside; nan, infinities and
+// overflow are rejected like they are in expressions.
+static bool field_value(const char *begin, const char *end, double &value)
+{
+	while (begin != end && (*begin == ' ' || *begin == '\t'))
+		++begin;
+	while (end != begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+		--end;
+	std::size_t length = end - begin;
+	if (length == 0)
+		return false;
+
+	// Short unsigned integers, the common field, are exact without strtod.
+	if (length <= 15)
+	{
+		double integer = 0.0;
+		const char *p = begin;
+		while (p != end && *p >= '0' && *p <= '9')
+			integer = integer * 10 + (*p++ - '0');
+		if (p == end)
+		{
+			value = integer;
+			return true;
+		}
+	}
+
+	char buffer[64];
+	if (length >= sizeof(buffer))
+		return false;
+	std::memcpy(buffer, begin, length);
+	buffer[length] = '\0';
+	char *parsed = NULL;
+	value = std::strtod(buffer, &parsed);
+	return parsed == buffer + length && value == value
+		&& value != HUGE_VAL && value != -HUGE_VAL;
+}
+
+const std::size_t RPNColumns::batch_rows;
+
+RPNColumns::RPNColumns(const std::string &expression, bool jit) : _rows(0), _lines(0), _output_fd(-1)
+{
+	RPN::compile(expression.data(), expression.data() + expression.size(), _program, true);
+	RPNOptimizer().optimize(_program);
+	if (jit)
+		_native.compile(_program, batch_rows);
+	_columns.resize(_program.columns * batch_rows);
+	_stack.resize(_program.max_depth * batch_rows);
+	_saved.resize(_program.saved * batch_rows);
+	_operands.resize(_program.max_depth);
+	_errors.resize(batch_rows);
+}
+
+RPNColumns::~RPNColumns()
+{
+}
+
+unsigned long RPNColumns::lines() const
+{
+	return _lines;
+}
+
+// Stores the fields the program references as the next row of the batch;
+// an unusable field becomes that row's error.
+void RPNColumns::load_row(const char *begin, const char *end)
+{
+	const char *error = NULL;
+	const char *field = begin;
+	for (std::size_t column = 0; column < _program.columns; ++column)
+	{
+		if (field > end)
+		{
+			error = "Error: missing column";
+			break;
+		}
+		const char *comma = static_cast<const char *>(std::memchr(field, ',', end - field));
+		if (comma == NULL)
+			comma = end;
+		if (!field_value(field, comma, _columns[column * batch_rows + _rows]))
+		{
+			error = "Error: invalid number";
+			break;
+		}
+		field = comma + 1;
+	}
+	_errors[_rows++] = error;
+}
+
+// Divides lane by lane; a zero divisor marks its row unless the row
+// already failed, which keeps the scalar evaluator's first-error order.
+void RPNColumns::divide(double *result, const double *dividend, const double *divisor, std::size_t count)
+{
+	for (std::size_t row = 0; row < count; row += lane_count)
+	{
+		Lanes lanes = load_lanes(divisor + row);
+		int zeros = zero_lanes(lanes);
+		if (zeros != 0)
+		{
+			for (std::size_t lane = 0; lane < lane_count; ++lane)
+				if ((zeros >> lane & 1) && row + lane < _rows && _errors[row + lane] == NULL)
+					_errors[row + lane] = "Error: division by zero";
+		}
+		store_lanes(result + row, div_lanes(load_lanes(dividend + row), lanes));
+	}
+}
+
+// Runs the native program on each gathered row that has no error yet,
+// leaving results where evaluate_batch() reads them.
+void RPNColumns::evaluate_native()
+{
+	double *results = &_stack[0];
+	for (std::size_t row = 0; row < _rows; ++row)
+		if (_errors[row] == NULL)
+			_errors[row] = _native.execute(_columns.empty() ? NULL : &_columns[row], results[row]);
+	_operands[0] = results;
+}
+
+// Evaluates the gathered rows and appends their output.
+void RPNColumns::evaluate_batch()
+{
+	if (_native.ready())
+		evaluate_native();
+	else
+		evaluate_lanes();
+	for (std::size_t row = 0; row < _rows; ++row)
+	{
+		if (_errors[row] == NULL)
+			append_number(_output, _operands[0][row]);
+		else
+			_output += _errors[row];
+		_output += '\n';
+	}
+	_lines += _rows;
+	_rows = 0;
+}
+
+// Runs the program once over the gathered rows. Column references are read
+// in place; only constants and intermediate results take stack storage.
+void RPNColumns::evaluate_lanes()
+{
+	std::size_t count = (_rows + lane_count - 1) / lane_count * lane_count;
+	std::size_t depth = 0;
+	const RPNInstruction *code = _program.code.empty() ? NULL : &_program.code[0];
+	const RPNInstruction *end = code + _program.code.size();
+	for (; code != end; ++code)
+	{
+		double *slot = (depth >= 2) ? &_stack[(depth - 2) * batch_rows] : NULL;
+		switch (code->op)
+		{
+		case RPN_PUSH:
+			slot = &_stack[depth * batch_rows];
+			fill(slot, code->value, count);
+			_operands[depth++] = slot;
+			break;
+		case RPN_LOAD:
+			_operands[depth++] = &_columns[static_cast<std::size_t>(code->value) * batch_rows];
+			break;
+		case RPN_STORE:
+			slot = &_saved[static_cast<std::size_t>(code->value) * batch_rows];
+			std::memcpy(slot, _operands[depth - 1], count * sizeof(double));
+			break;
+		case RPN_RECALL:
+			_operands[depth++] = &_saved[static_cast<std::size_t>(code->value) * batch_rows];
+			break;
+		case RPN_ADD:
+			combine<AddLanes>(slot, _operands[depth - 2], _operands[depth - 1], count);
+			_operands[--depth - 1] = slot;
+			break;
+		case RPN_SUB:
+			combine<SubLanes>(slot, _operands[depth - 2], _operands[depth - 1], count);
+			_operands[--depth - 1] = slot;
+			break;
+		case RPN_MUL:
+			combine<MulLanes>(slot, _operands[depth - 2], _operands[depth - 1], count);
+			_operands[--depth - 1] = slot;
+			break;
+		case RPN_DIV:
+			divide(slot, _operands[depth - 2], _operands[depth - 1], count);
+			_operands[--depth - 1] = slot;
+			break;
+		case RPN_FAIL:
+			for (std::size_t row = 0; row < _rows; ++row)
+				if (_errors[row] == NULL)
+					_errors[row] = _program.error.c_str();
+			code = end - 1;
+			break;
+		}
+	}
+}
+
+// Adds each line of a block as a row, evaluating every full batch, and
+// writes the block's output.
+bool RPNColumns::evaluate_block(const char *begin, const char *end)
+{
+	while (begin < end)
+	{
+		const char *line_end = static_cast<const char *>(std::memchr(begin, '\n', end - begin));
+		if (line_end == NULL)
+			line_end = end;
+		load_row(begin, line_end);
+		if (_rows == batch_rows)
+			evaluate_batch();
+		begin = line_end + 1;
+	}
+	bool written = write_all(_output_fd, _output.data(), _output.size());
+	_output.clear();
+	return written;
+}
+
+bool RPNColumns::consume_block(void *context, const char *begin, const char *end)
+{
+	return static_cast<RPNColumns *>(context)->evaluate_block(begin, end);
+}
+
+// Evaluates input_fd to the end; the rows of a partial last batch are
+// evaluated once the input is exhausted. False on a read or write error.
+bool RPNColumns::run(int input_fd, int output_fd)
+{
+	_output_fd = output_fd;
+	if (!read_blocks(input_fd, consume_block, this))
+		return false;
+	if (_rows != 0)
+		evaluate_batch();
+	bool written = write_all(_output_fd, _output.data(), _output.size());
+	_output.clear();
+	return written;
+}
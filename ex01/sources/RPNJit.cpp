@@ -0,0 +1,313 @@
+#include "RPNJit.hpp"
+#include <cstring>
+#if defined(__x86_64__) && defined(__linux__)
+#define RPN_JIT 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+typedef std::vector<unsigned char> Code;
+
+// The generated function follows the System V calling convention:
+// int f(const double *columns [rdi], double *result [rsi]), returning 0, or
+// 1 for a division by zero. Stack slot i lives in xmm i below
+// register_slots and at [rsp + 8 * (i - register_slots)] above; saved
+// slots follow the spilled ones in the frame. xmm15 and rax are scratch.
+// All of them are caller-saved, so nothing is preserved.
+static const std::size_t register_slots = 15;
+static const std::size_t max_spills = 4096;
+static const int scratch = 15;
+static const int rsp = 4;
+static const int rdi = 7;
+
+enum SSEOpcode
+{
+	MOVSD_LOAD = 0x10,
+	MOVSD_STORE = 0x11,
+	ADDSD = 0x58,
+	MULSD = 0x59,
+	SUBSD = 0x5C,
+	DIVSD = 0x5E
+};
+
+static void byte(Code &code, unsigned int value)
+{
+	code.push_back(static_cast<unsigned char>(value));
+}
+
+static void dword(Code &code, unsigned long value)
+{
+	for (int i = 0; i < 4; ++i)
+		byte(code, (value >> (8 * i)) & 0xFF);
+}
+
+// ModRM (and SIB for rsp) for [base + disp32].
+static void memory_operand(Code &code, int reg, int base, unsigned long disp)
+{
+	byte(code, 0x80 | (reg & 7) << 3 | base);
+	if (base == rsp)
+		byte(code, 0x24);
+	dword(code, disp);
+}
+
+// sd instruction between two xmm registers: reg = reg op rm.
+static void sse_registers(Code &code, SSEOpcode op, int reg, int rm)
+{
+	byte(code, 0xF2);
+	if (reg >= 8 || rm >= 8)
+		byte(code, 0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+	byte(code, 0x0F);
+	byte(code, op);
+	byte(code, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// sd instruction between an xmm register and [base + disp32].
+static void sse_memory(Code &code, SSEOpcode op, int reg, int base, unsigned long disp)
+{
+	byte(code, 0xF2);
+	if (reg >= 8)
+		byte(code, 0x44);
+	byte(code, 0x0F);
+	byte(code, op);
+	memory_operand(code, reg, base, disp);
+}
+
+// movq between rax and an xmm register: 0x6E into xmm, 0x7E out of it.
+static void movq_rax(Code &code, unsigned int op, int xmm)
+{
+	byte(code, 0x66);
+	byte(code, 0x48 | (xmm >= 8 ? 4 : 0));
+	byte(code, 0x0F);
+	byte(code, op);
+	byte(code, 0xC0 | (xmm & 7) << 3);
+}
+
+// mov between rax and [base + disp32]: 0x8B loads, 0x89 stores.
+static void mov_rax(Code &code, unsigned int op, int base, unsigned long disp)
+{
+	byte(code, 0x48);
+	byte(code, op);
+	memory_operand(code, 0, base, disp);
+}
+
+static unsigned long spill_offset(std::size_t slot)
+{
+	return 8 * (slot - register_slots);
+}
+
+static void epilogue(Code &code, unsigned long frame)
+{
+	if (frame != 0)
+	{
+		byte(code, 0x48);
+		byte(code, 0x81);
+		byte(code, 0xC4);
+		dword(code, frame);
+	}
+	byte(code, 0xC3);
+}
+
+RPNJit::RPNJit() : _page(NULL), _page_size(0), _function(NULL)
+{
+}
+
+RPNJit::~RPNJit()
+{
+	release();
+}
+
+void RPNJit::release()
+{
+#ifdef RPN_JIT
+	if (_page != NULL)
+		munmap(_page, _page_size);
+#endif
+	_page = NULL;
+	_page_size = 0;
+	_function = NULL;
+}
+
+bool RPNJit::ready() const
+{
+	return _function != NULL;
+}
+
+// Translates program one instruction at a time into _code. A column
+// reference $N + 1 reads columns[N * column_stride].
+void RPNJit::emit(const RPNProgram &program, std::size_t column_stride)
+{
+	Code &code = _code;
+	std::size_t spills = 0;
+	if (program.max_depth > register_slots)
+		spills = program.max_depth - register_slots;
+	unsigned long frame = (spills + program.saved) * 8;
+	std::vector<std::size_t> error_jumps;
+
+	code.clear();
+	if (frame != 0)
+	{
+		byte(code, 0x48);
+		byte(code, 0x81);
+		byte(code, 0xEC);
+		dword(code, frame);
+	}
+
+	std::size_t depth = 0;
+	for (std::size_t i = 0; i < program.code.size(); ++i)
+	{
+		const RPNInstruction &instruction = program.code[i];
+		if (instruction.op == RPN_STORE)
+		{
+			std::size_t slot = depth - 1;
+			unsigned long disp = 8 * (spills + static_cast<std::size_t>(instruction.value));
+			if (slot < register_slots)
+				sse_memory(code, MOVSD_STORE, slot, rsp, disp);
+			else
+			{
+				mov_rax(code, 0x8B, rsp, spill_offset(slot));
+				mov_rax(code, 0x89, rsp, disp);
+			}
+			continue;
+		}
+		if (instruction.op == RPN_PUSH || instruction.op == RPN_LOAD || instruction.op == RPN_RECALL)
+		{
+			std::size_t slot = depth++;
+			if (instruction.op != RPN_PUSH)
+			{
+				int base = rdi;
+				unsigned long disp = static_cast<unsigned long>(instruction.value) * column_stride * 8;
+				if (instruction.op == RPN_RECALL)
+				{
+					base = rsp;
+					disp = 8 * (spills + static_cast<std::size_t>(instruction.value));
+				}
+				if (slot < register_slots)
+					sse_memory(code, MOVSD_LOAD, slot, base, disp);
+				else
+				{
+					mov_rax(code, 0x8B, base, disp);
+					mov_rax(code, 0x89, rsp, spill_offset(slot));
+				}
+				continue;
+			}
+			unsigned char bits[8];
+			std::memcpy(bits, &instruction.value, sizeof(bits));
+			byte(code, 0x48);
+			byte(code, 0xB8);
+			for (int b = 0; b < 8; ++b)
+				byte(code, bits[b]);
+			if (slot < register_slots)
+				movq_rax(code, 0x6E, slot);
+			else
+				mov_rax(code, 0x89, rsp, spill_offset(slot));
+			continue;
+		}
+
+		std::size_t left = depth - 2;
+		std::size_t right = depth - 1;
+		--depth;
+		SSEOpcode op = ADDSD;
+		if (instruction.op == RPN_SUB)
+			op = SUBSD;
+		else if (instruction.op == RPN_MUL)
+			op = MULSD;
+		else if (instruction.op == RPN_DIV)
+		{
+			op = DIVSD;
+			// add rax, rax drops the sign bit: zero exactly for +0.0 and -0.0.
+			if (right < register_slots)
+				movq_rax(code, 0x7E, right);
+			else
+				mov_rax(code, 0x8B, rsp, spill_offset(right));
+			byte(code, 0x48);
+			byte(code, 0x01);
+			byte(code, 0xC0);
+			byte(code, 0x0F);
+			byte(code, 0x84);
+			error_jumps.push_back(code.size());
+			dword(code, 0);
+		}
+
+		if (right < register_slots)
+			sse_registers(code, op, left, right);
+		else if (left < register_slots)
+			sse_memory(code, op, left, rsp, spill_offset(right));
+		else
+		{
+			sse_memory(code, MOVSD_LOAD, scratch, rsp, spill_offset(left));
+			sse_memory(code, op, scratch, rsp, spill_offset(right));
+			sse_memory(code, MOVSD_STORE, scratch, rsp, spill_offset(left));
+		}
+	}
+
+	// movsd [rsi], xmm0; xor eax, eax
+	byte(code, 0xF2);
+	byte(code, 0x0F);
+	byte(code, 0x11);
+	byte(code, 0x06);
+	byte(code, 0x31);
+	byte(code, 0xC0);
+	epilogue(code, frame);
+
+	if (error_jumps.empty())
+		return;
+	std::size_t error_stub = code.size();
+	for (std::size_t i = 0; i < error_jumps.size(); ++i)
+	{
+		unsigned long rel = error_stub - (error_jumps[i] + 4);
+		for (int b = 0; b < 4; ++b)
+			code[error_jumps[i] + b] = (rel >> (8 * b)) & 0xFF;
+	}
+	// mov eax, 1
+	byte(code, 0xB8);
+	dword(code, 1);
+	epilogue(code, frame);
+}
+
+// Builds native code for program, replacing any earlier one. False when
+// the program has to run on the interpreter instead.
+bool RPNJit::compile(const RPNProgram &program, std::size_t column_stride)
+{
+	release();
+#ifdef RPN_JIT
+	if (program.max_depth == 0 || program.max_depth + program.saved > register_slots + max_spills)
+		return false;
+	for (std::size_t i = 0; i < program.code.size(); ++i)
+	{
+		if (program.code[i].op == RPN_FAIL)
+			return false;
+		if (program.code[i].op == RPN_LOAD
+			&& (program.code[i].value + 1) * column_stride * 8 > 0x7FFFFFFF)
+			return false;
+	}
+	emit(program, column_stride);
+
+	long page = sysconf(_SC_PAGESIZE);
+	std::size_t size = (_code.size() + page - 1) / page * page;
+	void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return false;
+	std::memcpy(memory, &_code[0], _code.size());
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(memory, size);
+		return false;
+	}
+	_page = memory;
+	_page_size = size;
+	_function = reinterpret_cast<Function>(memory);
+	return true;
+#else
+	(void)program;
+	(void)column_stride;
+	return false;
+#endif
+}
+
+// Runs the compiled code; same contract as RPN::execute.
+const char *RPNJit::execute(const double *columns, double &result) const
+{
+	if (_function(columns, &result) != 0)
+		return "Error: division by zero";
+	return NULL;
+}
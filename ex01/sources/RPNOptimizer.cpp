@@ -0,0 +1,195 @@
+#include "RPNOptimizer.hpp"
+#include <cstring>
+
+static const std::size_t none = static_cast<std::size_t>(-1);
+
+// Bit patterns rather than values, so 0 and -0 stay apart.
+bool RPNOptimizer::Key::operator<(const Key &other) const
+{
+	if (op != other.op)
+		return op < other.op;
+	if (bits[0] != other.bits[0])
+		return bits[0] < other.bits[0];
+	if (bits[1] != other.bits[1])
+		return bits[1] < other.bits[1];
+	if (left != other.left)
+		return left < other.left;
+	return right < other.right;
+}
+
+static double fold(RPNOpcode op, double left, double right)
+{
+	switch (op)
+	{
+	case RPN_ADD:
+		return left + right;
+	case RPN_SUB:
+		return left - right;
+	case RPN_MUL:
+		return left * right;
+	default:
+		return left / right;
+	}
+}
+
+RPNOptimizer::RPNOptimizer()
+{
+}
+
+RPNOptimizer::~RPNOptimizer()
+{
+}
+
+// The node for op over value or children, shared with an identical one.
+std::size_t RPNOptimizer::node(RPNOpcode op, double value, std::size_t left, std::size_t right)
+{
+	Key key;
+	key.op = op;
+	std::memcpy(key.bits, &value, sizeof(key.bits));
+	key.left = left;
+	key.right = right;
+	std::map<Key, std::size_t>::iterator found = _index.find(key);
+	if (found != _index.end())
+		return found->second;
+
+	Node created;
+	created.op = op;
+	created.value = value;
+	created.left = left;
+	created.right = right;
+	created.uses = 0;
+	created.slot = none;
+	_nodes.push_back(created);
+	_index.insert(std::make_pair(key, _nodes.size() - 1));
+	return _nodes.size() - 1;
+}
+
+// Replays program onto a stack of node indices. False when a divisor
+// folds to zero.
+bool RPNOptimizer::build(const RPNProgram &program)
+{
+	_nodes.clear();
+	_index.clear();
+	_stack.clear();
+	for (std::size_t i = 0; i < program.code.size(); ++i)
+	{
+		const RPNInstruction &instruction = program.code[i];
+		if (instruction.op == RPN_PUSH || instruction.op == RPN_LOAD)
+		{
+			_stack.push_back(node(instruction.op, instruction.value, none, none));
+			continue;
+		}
+		std::size_t right = _stack.back();
+		_stack.pop_back();
+		std::size_t left = _stack.back();
+		_stack.pop_back();
+		bool constant_left = (_nodes[left].op == RPN_PUSH);
+		bool constant_right = (_nodes[right].op == RPN_PUSH);
+		if (instruction.op == RPN_DIV && constant_right && _nodes[right].value == 0.0)
+			return false;
+		if (constant_left && constant_right)
+			_stack.push_back(node(RPN_PUSH, fold(instruction.op, _nodes[left].value, _nodes[right].value), none, none));
+		else
+			_stack.push_back(node(instruction.op, 0.0, left, right));
+	}
+	return true;
+}
+
+// Counts the references to each node reachable from root, visiting every
+// node's children once.
+void RPNOptimizer::count_uses(std::size_t root)
+{
+	_pending.clear();
+	_pending.push_back(root);
+	while (!_pending.empty())
+	{
+		Node &current = _nodes[_pending.back()];
+		_pending.pop_back();
+		if (current.uses++ != 0 || current.left == none)
+			continue;
+		_pending.push_back(current.right);
+		_pending.push_back(current.left);
+	}
+}
+
+// Emits the DAG under root in post-order, left operand first, as the
+// original program evaluated it. _pending holds node indices; an entry
+// with the top bit set is an operator whose operands are already emitted.
+void RPNOptimizer::emit(std::size_t root, RPNProgram &program)
+{
+	static const std::size_t operands_done = ~(none >> 1);
+	std::size_t depth = 0;
+
+	program.code.clear();
+	program.max_depth = 0;
+	program.saved = 0;
+	_pending.clear();
+	_pending.push_back(root);
+	while (!_pending.empty())
+	{
+		std::size_t entry = _pending.back();
+		_pending.pop_back();
+		Node &current = _nodes[entry & ~operands_done];
+		RPNInstruction instruction;
+		instruction.op = current.op;
+		instruction.value = current.value;
+		if (current.left == none)
+			++depth;
+		else if (current.slot != none)
+		{
+			instruction.op = RPN_RECALL;
+			instruction.value = static_cast<double>(current.slot);
+			++depth;
+		}
+		else if (!(entry & operands_done))
+		{
+			_pending.push_back(entry | operands_done);
+			_pending.push_back(current.right);
+			_pending.push_back(current.left);
+			continue;
+		}
+		else
+		{
+			--depth;
+			if (current.uses > 1)
+			{
+				program.code.push_back(instruction);
+				current.slot = program.saved++;
+				instruction.op = RPN_STORE;
+				instruction.value = static_cast<double>(current.slot);
+			}
+		}
+		program.code.push_back(instruction);
+		if (depth > program.max_depth)
+			program.max_depth = depth;
+	}
+}
+
+// Programs that already fail to compile, or were optimized before, are left
+// as they are.
+void RPNOptimizer::optimize(RPNProgram &program)
+{
+	if (program.code.empty())
+		return;
+	for (std::size_t i = 0; i < program.code.size(); ++i)
+	{
+		RPNOpcode op = program.code[i].op;
+		if (op == RPN_FAIL || op == RPN_STORE || op == RPN_RECALL)
+			return;
+	}
+
+	if (!build(program))
+	{
+		RPNInstruction instruction;
+		instruction.op = RPN_FAIL;
+		instruction.value = 0.0;
+		program.code.assign(1, instruction);
+		program.max_depth = 0;
+		program.saved = 0;
+		program.error = "Error: division by zero";
+		return;
+	}
+	std::size_t root = _stack.back();
+	count_uses(root);
+	emit(root, program);
+}
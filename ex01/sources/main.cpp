@@ -1,9 +1,131 @@
 #include "RPN.hpp"
+#include "RPNBatch.hpp"
+#include "RPNColumns.hpp"
+#include "RPNJit.hpp"
+#include "RPNOptimizer.hpp"
+#include "Parallel.hpp"
 #include <iostream>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+static double monotonic_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// RPN --batch [--jobs N] [FILE]: one expression per line from FILE, or
+// stdin when FILE is missing or "-".
+static int run_batch(int ac, char **av)
+{
+	unsigned int jobs = hardware_threads();
+	const char *file = NULL;
+	for (int i = 2; i < ac; ++i)
+	{
+		std::string arg = av[i];
+		if (arg == "--jobs")
+		{
+			char *end = NULL;
+			long value = (i + 1 < ac) ? std::strtol(av[i + 1], &end, 10) : -1;
+			if (value < 0 || value > 1024 || end == av[i + 1] || *end != '\0')
+			{
+				std::cerr << "Error: --jobs expects a thread count" << std::endl;
+				return 1;
+			}
+			if (value > 0)
+				jobs = static_cast<unsigned int>(value);
+			++i;
+		}
+		else if (file == NULL)
+			file = av[i];
+		else
+		{
+			std::cerr << "Error: invalid number of arguments" << std::endl;
+			return 1;
+		}
+	}
+
+	int fd = STDIN_FILENO;
+	if (file != NULL && std::string(file) != "-")
+		fd = open(file, O_RDONLY);
+	if (fd < 0)
+	{
+		std::cerr << "Error: could not open file: " << file << std::endl;
+		return 1;
+	}
+
+	RPNBatch batch(jobs);
+	double start = monotonic_seconds();
+	bool ok = batch.run(fd, STDOUT_FILENO);
+	double elapsed = monotonic_seconds() - start;
+	if (fd != STDIN_FILENO)
+		close(fd);
+	if (!ok)
+	{
+		std::cerr << "Error: batch I/O failed" << std::endl;
+		return 1;
+	}
+	std::cerr << batch.lines() << " lines in " << elapsed << " s ("
+		<< static_cast<unsigned long>(elapsed > 0 ? batch.lines() / elapsed : 0)
+		<< " lines/sec, " << jobs << " threads)" << std::endl;
+	return 0;
+}
+
+// RPN --columns [--jit] EXPR [FILE]: EXPR evaluated for each row of
+// comma-separated numbers in FILE, or stdin when FILE is missing or "-";
+// "$N" in EXPR is field N of the row.
+static int run_columns(int ac, char **av)
+{
+	int first = 2;
+	bool jit = (ac > 2 && std::string(av[2]) == "--jit");
+	if (jit)
+		++first;
+	if (ac < first + 1 || ac > first + 2)
+	{
+		std::cerr << "Error: invalid number of arguments" << std::endl;
+		return 1;
+	}
+	const char *file = (ac == first + 2) ? av[first + 1] : NULL;
+	int fd = STDIN_FILENO;
+	if (file != NULL && std::string(file) != "-")
+		fd = open(file, O_RDONLY);
+	if (fd < 0)
+	{
+		std::cerr << "Error: could not open file: " << file << std::endl;
+		return 1;
+	}
+
+	RPNColumns columns(av[first], jit);
+	double start = monotonic_seconds();
+	bool ok = columns.run(fd, STDOUT_FILENO);
+	double elapsed = monotonic_seconds() - start;
+	if (fd != STDIN_FILENO)
+		close(fd);
+	if (!ok)
+	{
+		std::cerr << "Error: columns I/O failed" << std::endl;
+		return 1;
+	}
+	std::cerr << columns.lines() << " rows in " << elapsed << " s ("
+		<< static_cast<unsigned long>(elapsed > 0 ? columns.lines() / elapsed : 0)
+		<< " rows/sec)" << std::endl;
+	return 0;
+}
 
 int main(int ac, char **av)
 {
-	if (ac != 2)
+	if (ac >= 2 && std::string(av[1]) == "--batch")
+		return run_batch(ac, av);
+	if (ac >= 2 && std::string(av[1]) == "--columns")
+		return run_columns(ac, av);
+
+	// RPN --jit EXPR optimizes EXPR and runs it as native code where there
+	// is a JIT.
+	bool jit = (ac == 3 && std::string(av[1]) == "--jit");
+	if (ac != 2 && !jit)
 	{
 		std::cerr << "Error: invalid number of arguments" << std::endl;
 		return 1;
@@ -12,7 +134,18 @@ int main(int ac, char **av)
 	try
 	{
 		RPN rpn;
-		rpn.evaluate(av[1]);
+		if (jit)
+		{
+			RPNProgram program = RPN::compile(av[2]);
+			RPNOptimizer().optimize(program);
+			RPNJit native;
+			if (native.compile(program))
+				rpn.run(native);
+			else
+				rpn.run(program);
+		}
+		else
+			rpn.evaluate(av[1]);
 		double result = rpn.getResult();
 		std::cout << result << std::endl;
 	}